@@ -0,0 +1,122 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+
+// Maps an IPv4 address and port to a 16 bit id. Open addressing with linear probing, each
+// slot is one atomic word holding both the key and the id, so lookups never lock. Writers
+// take a mutex and erase by shifting later entries back, so the table never fills with
+// tombstones and probes stay short. A lookup that misses while a writer moved entries
+// looks again, see find.
+namespace address_index {
+  const uint16_t NOT_FOUND = 0xffff;
+  // longest probe sequence, inserts that would need more are refused
+  const size_t MAX_PROBES = 64;
+
+  class AddressIndex {
+  public:
+    // keeps the table at most half full with capacity entries
+    void init(size_t capacity) {
+      bits = 1;
+      while(((size_t)1 << bits) < capacity * 2) bits++;
+      mask = ((size_t)1 << bits) - 1;
+      slots = std::make_unique<std::atomic<uint64_t>[]>(mask + 1);
+      // addresses and ports come from the network, a random seed keeps them from being
+      // picked to collide
+      std::random_device random;
+      seed = ((uint64_t)random() << 32) | random();
+    }
+
+    // ip and port in network byte order, as they are in sockaddr_in
+    uint16_t find(uint32_t ip, uint16_t port) const {
+      uint64_t key = make_key(ip, port);
+      while(true) {
+        uint64_t version = writes.load(std::memory_order_acquire);
+        for(size_t i = home(key), probes = 0; probes < MAX_PROBES; i = (i + 1) & mask, probes++) {
+          uint64_t slot = slots[i].load(std::memory_order_acquire);
+          if(slot == EMPTY) break;
+          if((slot >> 16) == key) return (uint16_t)slot;
+        }
+        // a miss only counts when no write was under way or finished during the probe
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(version % 2 == 0 && writes.load(std::memory_order_relaxed) == version) return NOT_FOUND;
+      }
+    }
+
+    // false when the key is already present or its probe sequence is full
+    bool insert(uint32_t ip, uint16_t port, uint16_t id) {
+      uint64_t key = make_key(ip, port);
+      std::lock_guard<std::mutex> lock(writer);
+      for(size_t i = home(key), probes = 0; probes < MAX_PROBES; i = (i + 1) & mask, probes++) {
+        uint64_t slot = slots[i].load(std::memory_order_relaxed);
+        if(slot != EMPTY && (slot >> 16) == key) return false;
+        if(slot == EMPTY) {
+          // a single store, readers see the entry whole or not at all
+          slots[i].store((key << 16) | id, std::memory_order_release);
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // removes the entry only while it still maps to id
+    void erase(uint32_t ip, uint16_t port, uint16_t id) {
+      uint64_t key = make_key(ip, port);
+      uint64_t entry = (key << 16) | id;
+      std::lock_guard<std::mutex> lock(writer);
+      size_t hole = home(key);
+      for(size_t probes = 0;; hole = (hole + 1) & mask, probes++) {
+        uint64_t slot = slots[hole].load(std::memory_order_relaxed);
+        if(probes == MAX_PROBES || slot == EMPTY) return;
+        if(slot == entry) break;
+      }
+
+      begin_write();
+      // every later entry of the run that may live in the hole moves into it
+      for(size_t i = (hole + 1) & mask;; i = (i + 1) & mask) {
+        uint64_t slot = slots[i].load(std::memory_order_relaxed);
+        if(slot == EMPTY) break;
+        size_t slot_home = home(slot >> 16);
+        // entries whose home lies cyclically in (hole, i] have to stay behind the hole
+        bool stays = hole <= i ? (hole < slot_home && slot_home <= i) : (hole < slot_home || slot_home <= i);
+        if(stays) continue;
+        slots[hole].store(slot, std::memory_order_relaxed);
+        hole = i;
+      }
+      slots[hole].store(EMPTY, std::memory_order_relaxed);
+      end_write();
+    }
+
+  private:
+    // address 0.0.0.0 never sends, so an all zero word is free
+    static const uint64_t EMPTY = 0;
+
+    static uint64_t make_key(uint32_t ip, uint16_t port) {
+      return ((uint64_t)ip << 16) | port;
+    }
+
+    size_t home(uint64_t key) const {
+      return ((key ^ seed) * 0x9E3779B97F4A7C15ull) >> (64 - bits);
+    }
+
+    // odd while entries move, like a seqlock
+    void begin_write() {
+      writes.store(writes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void end_write() {
+      writes.store(writes.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    std::unique_ptr<std::atomic<uint64_t>[]> slots;
+    size_t mask = 0;
+    int bits = 1;
+    uint64_t seed = 0;
+    std::mutex writer;
+    std::atomic<uint64_t> writes = 0;
+  };
+}
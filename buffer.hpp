@@ -0,0 +1,80 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace buffer {
+  class Pool;
+
+  // Receive buffer shared by every packet parsed out of it. It goes back to its pool
+  // when the last reference is released, from whichever thread that happens on.
+  struct Buffer {
+    std::atomic<int> refs = 0;
+    Buffer *next = nullptr;
+    Pool *pool = nullptr;
+    uint16_t id = 0;
+    uint8_t *data = nullptr;
+  };
+
+  inline void retain(Buffer *buffer) {
+    buffer->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  inline void release(Buffer *buffer);
+
+  // Fixed set of equally sized buffers. Only the owning thread acquires, any thread releases.
+  class Pool {
+  public:
+    void init(int count, size_t size) {
+      buffer_size = size;
+      storage.resize(count * size);
+      buffers = std::vector<Buffer>(count);
+      for(int i = 0; i < count; i++) {
+        buffers[i].pool = this;
+        buffers[i].id = i;
+        buffers[i].data = &storage[i * size];
+        buffers[i].next = i + 1 < count ? &buffers[i + 1] : nullptr;
+      }
+      free_list = count > 0 ? &buffers[0] : nullptr;
+    }
+
+    // owner thread only, returns a buffer holding one reference or nullptr when all are in use
+    Buffer *acquire() {
+      if(free_list == nullptr) {
+        free_list = released.exchange(nullptr, std::memory_order_acquire);
+        if(free_list == nullptr) return nullptr;
+      }
+      Buffer *buffer = free_list;
+      free_list = buffer->next;
+      buffer->refs.store(1, std::memory_order_relaxed);
+      return buffer;
+    }
+
+    Buffer *get(int id) { return &buffers[id]; }
+    int count() const { return buffers.size(); }
+    size_t size() const { return buffer_size; }
+
+  private:
+    friend void release(Buffer *buffer);
+
+    void put_back(Buffer *buffer) {
+      Buffer *head = released.load(std::memory_order_relaxed);
+      do {
+        buffer->next = head;
+      } while(!released.compare_exchange_weak(head, buffer, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    std::vector<uint8_t> storage;
+    std::vector<Buffer> buffers;
+    size_t buffer_size = 0;
+    // owner thread only
+    Buffer *free_list = nullptr;
+    // pushed by any thread, taken as a whole by the owner so there is no ABA problem
+    std::atomic<Buffer*> released = nullptr;
+  };
+
+  inline void release(Buffer *buffer) {
+    if(buffer->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) buffer->pool->put_back(buffer);
+  }
+}
@@ -0,0 +1,212 @@
+#include "config.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+namespace config {
+  // 0xffff is kept for "no client" and "no session"
+  const size_t MAX_IDS = 65535;
+
+  bool parse_size(const std::string &value, size_t min, size_t max, size_t &out) {
+    char *end;
+    errno = 0;
+    unsigned long long parsed = strtoull(value.c_str(), &end, 10);
+    if(value.empty() || *end != '\0' || errno != 0 || value[0] == '-' || parsed < min || parsed > max) return false;
+    out = parsed;
+    return true;
+  }
+
+  bool parse_float(const std::string &value, float &out) {
+    char *end;
+    float parsed = strtof(value.c_str(), &end);
+    if(value.empty() || *end != '\0' || !(parsed > 0.0f)) return false;
+    out = parsed;
+    return true;
+  }
+
+  // like parse_float, but any finite value goes
+  bool parse_number(const std::string &value, float &out) {
+    char *end;
+    float parsed = strtof(value.c_str(), &end);
+    if(value.empty() || *end != '\0' || !std::isfinite(parsed)) return false;
+    out = parsed;
+    return true;
+  }
+
+  bool parse_bool(const std::string &value, bool &out) {
+    if(value == "1" || value == "true" || value == "yes" || value == "on") out = true;
+    else if(value == "0" || value == "false" || value == "no" || value == "off") out = false;
+    else return false;
+    return true;
+  }
+
+  // keys are the same in the file and on the command line, where - may stand for _
+  bool set(Config &config, std::string key, const std::string &value) {
+    for(char &c : key) {
+      if(c == '-') c = '_';
+    }
+    size_t number;
+    bool valid;
+    if(key == "port") {
+      valid = parse_size(value, 1, 65535, number);
+      if(valid) config.port = number;
+    } else if(key == "listeners") {
+      valid = parse_size(value, 1, MAX_LISTENERS, number);
+      if(valid) config.listeners = number;
+    } else if(key == "pin_listeners") {
+      valid = parse_bool(value, config.pin_listeners);
+    } else if(key == "backend") {
+      valid = event_loop::parse_backend(value, config.backend);
+    } else if(key == "clients") {
+      valid = parse_size(value, 1, MAX_IDS, config.clients);
+    } else if(key == "sessions") {
+      valid = parse_size(value, 0, MAX_IDS, config.sessions);
+    } else if(key == "max_packets") {
+      valid = parse_size(value, 1, SIZE_MAX / 2, config.max_packets);
+    } else if(key == "stale_time") {
+      valid = parse_float(value, config.stale_time_s);
+    } else if(key == "pool_chunk") {
+      valid = parse_size(value, 1, MAX_IDS, config.pool_chunk);
+    } else if(key == "huge_pages") {
+      valid = parse_bool(value, config.huge_pages);
+    } else if(key == "tick_rate") {
+      valid = parse_size(value, 0, 1000, number);
+      if(valid) config.tick_rate = number;
+    } else if(key == "field_min_x") {
+      valid = parse_number(value, config.field_min_x);
+    } else if(key == "field_max_x") {
+      valid = parse_number(value, config.field_max_x);
+    } else if(key == "field_min_y") {
+      valid = parse_number(value, config.field_min_y);
+    } else if(key == "field_max_y") {
+      valid = parse_number(value, config.field_max_y);
+    } else if(key == "max_direction") {
+      valid = parse_float(value, config.max_direction);
+    } else if(key == "position_rate") {
+      valid = parse_size(value, 0, 1'000'000, number);
+      if(valid) config.position_rate = number;
+    } else if(key == "control_rate") {
+      valid = parse_size(value, 0, 1'000'000, number);
+      if(valid) config.control_rate = number;
+    } else if(key == "connect_rate") {
+      valid = parse_size(value, 0, 1'000'000, number);
+      if(valid) config.connect_rate = number;
+    } else if(key == "metrics_socket") {
+      config.metrics_socket = value;
+      valid = true;
+    } else {
+      fprintf(stderr, "unknown setting '%s'\n", key.c_str());
+      return false;
+    }
+    if(!valid) fprintf(stderr, "invalid value '%s' for %s\n", value.c_str(), key.c_str());
+    return valid;
+  }
+
+  std::string trim(const std::string &text) {
+    size_t begin = text.find_first_not_of(" \t\r");
+    if(begin == std::string::npos) return "";
+    size_t end = text.find_last_not_of(" \t\r");
+    return text.substr(begin, end - begin + 1);
+  }
+
+  // key = value per line, # starts a comment
+  bool load_file(const char *path, Config &config) {
+    std::ifstream file(path);
+    if(!file) {
+      fprintf(stderr, "could not open config file %s\n", path);
+      return false;
+    }
+    std::string line;
+    for(int number = 1; std::getline(file, line); number++) {
+      line = trim(line.substr(0, line.find('#')));
+      if(line.empty()) continue;
+      size_t equals = line.find('=');
+      if(equals == std::string::npos) {
+        fprintf(stderr, "%s:%d: expected key = value\n", path, number);
+        return false;
+      }
+      if(!set(config, trim(line.substr(0, equals)), trim(line.substr(equals + 1)))) {
+        fprintf(stderr, "%s:%d: in config file\n", path, number);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // --key=value or --key value
+  bool split_flag(int argc, char **argv, int &i, std::string &key, std::string &value) {
+    std::string arg = argv[i];
+    if(arg.rfind("--", 0) != 0 || arg.size() == 2) {
+      fprintf(stderr, "unexpected argument '%s'\n", argv[i]);
+      return false;
+    }
+    size_t equals = arg.find('=');
+    if(equals != std::string::npos) {
+      key = arg.substr(2, equals - 2);
+      value = arg.substr(equals + 1);
+      return true;
+    }
+    key = arg.substr(2);
+    if(i + 1 == argc) {
+      fprintf(stderr, "missing value for %s\n", argv[i]);
+      return false;
+    }
+    value = argv[++i];
+    return true;
+  }
+
+  bool load(int argc, char **argv, Config &config) {
+    std::string key, value;
+    // the file goes first wherever it is given, so flags always win over it
+    for(int i = 1; i < argc; i++) {
+      if(strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+        print_usage(argv[0]);
+        exit(0);
+      }
+      if(!split_flag(argc, argv, i, key, value)) return false;
+      if(key == "config" && !load_file(value.c_str(), config)) return false;
+    }
+    for(int i = 1; i < argc; i++) {
+      split_flag(argc, argv, i, key, value);
+      if(key != "config" && !set(config, key, value)) return false;
+    }
+
+    if(!(config.field_min_x < config.field_max_x) || !(config.field_min_y < config.field_max_y)) {
+      fprintf(stderr, "the field minimum has to be below its maximum\n");
+      return false;
+    }
+    if(config.sessions == 0) config.sessions = std::max<size_t>(1, config.clients / 2);
+    return true;
+  }
+
+  void print_usage(const char *program) {
+    Config defaults;
+    printf("usage: %s [--config FILE] [--SETTING VALUE]...\n\n", program);
+    printf("settings, also accepted as SETTING = VALUE lines in the config file:\n");
+    printf("  port         UDP port to listen on (%d)\n", defaults.port);
+    printf("  listeners    sockets on the port, each read by its own thread, up to %d (%d)\n", MAX_LISTENERS, defaults.listeners);
+    printf("  pin_listeners  pin every listener thread to its own cpu (%s)\n", defaults.pin_listeners ? "true" : "false");
+    printf("  backend      event loop the listeners run, epoll or io_uring (%s)\n", event_loop::backend_name(defaults.backend));
+    printf("  clients      maximum number of connected clients, up to 65535 (%zu)\n", defaults.clients);
+    printf("  sessions     maximum number of sessions, up to 65535 (half of clients)\n");
+    printf("  max_packets  packets waiting for processing across all shards (%zu)\n", defaults.max_packets);
+    printf("  stale_time   seconds without a message before a client may be replaced (%g)\n", defaults.stale_time_s);
+    printf("  pool_chunk   client and session slots allocated at a time (%zu)\n", defaults.pool_chunk);
+    printf("  huge_pages   back the client and session pools with huge pages (%s)\n", defaults.huge_pages ? "true" : "false");
+    printf("  tick_rate    position broadcasts per second, 0 relays as they come (%d)\n", defaults.tick_rate);
+    printf("  field_min_x, field_max_x, field_min_y, field_max_y\n");
+    printf("               field bounds for compact snapshots (%g..%g, %g..%g)\n", defaults.field_min_x, defaults.field_max_x, defaults.field_min_y, defaults.field_max_y);
+    printf("  max_direction  largest direction component in compact snapshots (%g)\n", defaults.max_direction);
+    printf("  position_rate  position updates and snapshot acks per second from one source, 0 for no limit (%d)\n", defaults.position_rate);
+    printf("  control_rate   other packets per second from one source, 0 for no limit (%d)\n", defaults.control_rate);
+    printf("  connect_rate   CONNECT packets per second from one IP address, 0 for no limit (%d)\n", defaults.connect_rate);
+    printf("  metrics_socket unix socket path serving metrics in the Prometheus text format (none)\n");
+  }
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+#include "event_loop.hpp"
+
+// Server settings chosen at startup. The defaults below are overridden by the file given
+// with --config, which is overridden by the other command line flags.
+namespace config {
+  // the server keeps per listener rings in every shard, sized for this many
+  const int MAX_LISTENERS = 16;
+
+  struct Config {
+    int port = 8080;
+    // more than one listener opens that many SO_REUSEPORT sockets on the port, each read by
+    // its own thread, optionally pinned to a cpu of its own
+    int listeners = 1;
+    bool pin_listeners = false;
+    // io_uring falls back to epoll when the kernel can not set it up
+    event_loop::Backend backend = event_loop::Backend::EPOLL;
+    // client and session ids are 16 bit on the wire and 0xffff means none, so neither
+    // count can exceed 65535
+    size_t clients = 1024;
+    size_t sessions = 0; // 0 means half of clients
+    size_t max_packets = 100'000; // shared by all the rings between listeners and shards
+    float stale_time_s = 10.0;
+    // client and session slots are allocated this many at a time, as shards run out
+    size_t pool_chunk = 256;
+    bool huge_pages = false;
+    // positions are broadcast this many times a second, 0 relays them as soon as they are
+    // handled, only the newest when several wait
+    int tick_rate = 0;
+    // compact snapshots quantize positions over the field and directions over
+    // -max_direction..max_direction, anything outside is clamped
+    float field_min_x = 0.0f;
+    float field_max_x = 1152.0f;
+    float field_min_y = 0.0f;
+    float field_max_y = 648.0f;
+    float max_direction = 1.0f;
+    // packets per second each source may send, 0 for no limit. Positions include snapshot
+    // acks, so the position rate has to cover the client's frame rate plus the tick rate.
+    int position_rate = 500;
+    int control_rate = 50;
+    int connect_rate = 5; // per IP address, whatever the port
+    // unix socket serving metrics in the Prometheus text format, empty for none
+    std::string metrics_socket;
+  };
+
+  // prints what is wrong to stderr and returns false on unknown keys or bad values
+  bool load(int argc, char **argv, Config &config);
+  void print_usage(const char *program);
+}
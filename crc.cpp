@@ -0,0 +1,176 @@
+#include "crc.hpp"
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC_HAS_X86 1
+#endif
+
+namespace crc {
+  // below this length folding does not pay for its setup and final reduction
+  const size_t CLMUL_MIN_LEN = 32;
+
+  // tables[k][b] is the crc of byte b followed by k zero bytes
+  using Tables = std::array<std::array<uint16_t, 256>, 8>;
+
+  constexpr Tables make_tables() {
+    Tables tables = {};
+    for(int b = 0; b < 256; b++) {
+      uint16_t crc = b;
+      for(int i = 0; i < 8; i++) {
+        crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+      }
+      tables[0][b] = crc;
+    }
+    for(int k = 1; k < 8; k++) {
+      for(int b = 0; b < 256; b++) {
+        uint16_t prev = tables[k - 1][b];
+        tables[k][b] = (prev >> 8) ^ tables[0][prev & 0xff];
+      }
+    }
+    return tables;
+  }
+
+  constexpr Tables TABLES = make_tables();
+
+  uint16_t update_bitwise(uint16_t crc, const uint8_t *data, size_t len) {
+    if(!data) return crc;
+
+    while(len--) {
+      crc ^= *data++;
+      for(int i = 0; i < 8; i++) {
+        if(crc & 1) crc = (crc >> 1) ^ POLY;
+        else        crc = (crc >> 1);
+      }
+    }
+    return crc;
+  }
+
+  uint16_t update_table(uint16_t crc, const uint8_t *data, size_t len) {
+    if(!data) return crc;
+
+    while(len--) {
+      crc = (crc >> 8) ^ TABLES[0][(crc ^ *data++) & 0xff];
+    }
+    return crc;
+  }
+
+  uint16_t update_slice8(uint16_t crc, const uint8_t *data, size_t len) {
+    if(!data) return crc;
+
+    while(len >= 8) {
+      uint64_t word;
+      memcpy(&word, data, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      word = __builtin_bswap64(word);
+#endif
+      word ^= crc;
+      crc = TABLES[7][word & 0xff] ^ TABLES[6][(word >> 8) & 0xff] ^
+            TABLES[5][(word >> 16) & 0xff] ^ TABLES[4][(word >> 24) & 0xff] ^
+            TABLES[3][(word >> 32) & 0xff] ^ TABLES[2][(word >> 40) & 0xff] ^
+            TABLES[1][(word >> 48) & 0xff] ^ TABLES[0][word >> 56];
+      data += 8;
+      len -= 8;
+    }
+    return update_table(crc, data, len);
+  }
+
+  // x^n mod P with P = x^16 + x^12 + x^5 + 1 in normal (not reflected) bit order
+  constexpr uint32_t xpow_mod(int n) {
+    uint32_t r = 1;
+    for(int i = 0; i < n; i++) {
+      r <<= 1;
+      if(r & 0x10000) r ^= 0x11021;
+    }
+    return r;
+  }
+
+  // moves coefficient x^e to bit 63 - e, the layout the reflected registers use
+  constexpr uint64_t reflect64(uint32_t value) {
+    uint64_t r = 0;
+    for(int e = 0; e < 16; e++) {
+      if(value & (1u << e)) r |= 1ull << (63 - e);
+    }
+    return r;
+  }
+
+#ifdef CRC_HAS_X86
+  // The 16 byte accumulator holds a value congruent (mod P) to everything folded so far.
+  // Folding multiplies its low half by x^192 and its high half by x^128. The constants
+  // use one power less because a reflected carry-less product comes out shifted by one bit.
+  const uint64_t FOLD_LO = reflect64(xpow_mod(191));
+  const uint64_t FOLD_HI = reflect64(xpow_mod(127));
+
+  __attribute__((target("pclmul,sse2")))
+  uint16_t update_clmul(uint16_t crc, const uint8_t *data, size_t len) {
+    if(!data) return crc;
+    if(len < 16) return update_slice8(crc, data, len);
+
+    const __m128i constants = _mm_set_epi64x(FOLD_HI, FOLD_LO);
+    __m128i acc = _mm_loadu_si128((const __m128i*)data);
+    acc = _mm_xor_si128(acc, _mm_cvtsi32_si128(crc));
+    data += 16;
+    len -= 16;
+
+    while(len >= 16) {
+      __m128i lo = _mm_clmulepi64_si128(acc, constants, 0x00);
+      __m128i hi = _mm_clmulepi64_si128(acc, constants, 0x11);
+      acc = _mm_xor_si128(_mm_xor_si128(lo, hi), _mm_loadu_si128((const __m128i*)data));
+      data += 16;
+      len -= 16;
+    }
+
+    uint8_t folded[16];
+    _mm_storeu_si128((__m128i*)folded, acc);
+    crc = update_slice8(0, folded, sizeof(folded));
+    return update_slice8(crc, data, len);
+  }
+
+  bool has_clmul() {
+    static const bool supported = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse2");
+    return supported;
+  }
+#else
+  uint16_t update_clmul(uint16_t crc, const uint8_t *data, size_t len) {
+    return update_slice8(crc, data, len);
+  }
+
+  bool has_clmul() {
+    return false;
+  }
+#endif
+
+  uint16_t update(uint16_t crc, const uint8_t *data, size_t len) {
+    if(len >= CLMUL_MIN_LEN && has_clmul()) return update_clmul(crc, data, len);
+    return update_slice8(crc, data, len);
+  }
+
+  const char *implementation_name() {
+    return has_clmul() ? "clmul + slice-by-8" : "slice-by-8";
+  }
+
+  bool self_check() {
+    uint8_t data[1024];
+    uint32_t seed = 0x12345678;
+    for(size_t i = 0; i < sizeof(data); i++) {
+      seed = seed * 1103515245 + 12345;
+      data[i] = seed >> 16;
+    }
+
+    const uint16_t inits[] = {0x0000, 0xffff, 0x1d0f};
+    for(uint16_t init : inits) {
+      for(size_t offset = 0; offset < 8; offset++) {
+        for(size_t len = 0; len + offset <= sizeof(data); len += len < 96 ? 1 : 37) {
+          uint16_t expected = update_bitwise(init, data + offset, len);
+          if(update_table(init, data + offset, len) != expected) return false;
+          if(update_slice8(init, data + offset, len) != expected) return false;
+          if(has_clmul() && update_clmul(init, data + offset, len) != expected) return false;
+          if(update(init, data + offset, len) != expected) return false;
+        }
+      }
+    }
+    return true;
+  }
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// CRC-16/MCRF4XX (reflected polynomial 0x8408, no final xor)
+namespace crc {
+  const uint16_t POLY = 0x8408;
+
+  // picks the fastest implementation the cpu supports
+  uint16_t update(uint16_t crc, const uint8_t *data, size_t len);
+
+  // one bit at a time, kept as the reference for the other implementations
+  uint16_t update_bitwise(uint16_t crc, const uint8_t *data, size_t len);
+  uint16_t update_table(uint16_t crc, const uint8_t *data, size_t len);
+  uint16_t update_slice8(uint16_t crc, const uint8_t *data, size_t len);
+  // carry-less multiply folding, only call when has_clmul() is true
+  uint16_t update_clmul(uint16_t crc, const uint8_t *data, size_t len);
+
+  bool has_clmul();
+  const char *implementation_name();
+
+  // compares every available implementation with update_bitwise
+  bool self_check();
+}
@@ -0,0 +1,80 @@
+// Throughput of every crc implementation in bytes per cycle, on buffers the size of the
+// packets the server handles and on larger ones. Cycles are read from the time stamp
+// counter, which on recent cpus ticks at a fixed rate close to the base clock.
+#include "crc.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  // without a cycle counter nanoseconds stand in for cycles
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct Implementation {
+  const char *name;
+  uint16_t (*update)(uint16_t crc, const uint8_t *data, size_t len);
+};
+
+// a volatile sink keeps the compiler from dropping the calls
+volatile uint16_t sink;
+
+double bytes_per_cycle(const Implementation &implementation, const std::vector<uint8_t> &data) {
+  // about 64MB per measurement, the best of a few runs is kept
+  size_t repeats = std::max<size_t>(1, ((size_t)64 << 20) / data.size());
+  if(implementation.update == crc::update_bitwise) repeats = std::max<size_t>(1, repeats / 16);
+  double best = 0;
+  for(int run = 0; run < 5; run++) {
+    uint16_t crc = 0xffff;
+    uint64_t start = cycles();
+    for(size_t i = 0; i < repeats; i++) {
+      crc = implementation.update(crc, data.data(), data.size());
+    }
+    uint64_t elapsed = cycles() - start;
+    sink = crc;
+    best = std::max(best, (double)(repeats * data.size()) / (double)std::max<uint64_t>(elapsed, 1));
+  }
+  return best;
+}
+
+int main() {
+  if(!crc::self_check()) {
+    fprintf(stderr, "crc self check failed\n");
+    return 1;
+  }
+
+  std::vector<Implementation> implementations = {
+    {"bitwise", crc::update_bitwise},
+    {"table", crc::update_table},
+    {"slice8", crc::update_slice8}
+  };
+  if(crc::has_clmul()) implementations.push_back({"clmul", crc::update_clmul});
+  else printf("clmul not supported on this cpu, skipped\n");
+
+  // a position update, a snapshot, a full datagram and sizes well past any packet
+  const size_t sizes[] = {28, 64, 1472, 16384, 1 << 20};
+
+  printf("%-10s", "bytes");
+  for(auto &implementation : implementations) printf("%12s", implementation.name);
+  printf("\n");
+  for(size_t size : sizes) {
+    std::vector<uint8_t> data(size);
+    for(size_t i = 0; i < size; i++) data[i] = (uint8_t)(i * 131 + 7);
+    printf("%-10zu", size);
+    for(auto &implementation : implementations) {
+      printf("%12.3f", bytes_per_cycle(implementation, data));
+    }
+    printf("\n");
+  }
+  printf("bytes per cycle, best of 5 runs\n");
+  return 0;
+}
@@ -0,0 +1,452 @@
+#include "event_loop.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "logger.hpp"
+
+namespace event_loop {
+  namespace {
+    class EpollLoop : public Loop {
+    public:
+      // how long to wait for shards to give buffers back when all of them are in use
+      static const int STARVED_WAIT_MS = 1;
+
+      EpollLoop(const Config &config)
+        : config(config),
+          slots(config.batch_size, nullptr),
+          addrs(config.batch_size),
+          iovecs(config.batch_size),
+          msgs(config.batch_size),
+          datagrams(config.batch_size) {
+        for(int m = 0; m < config.batch_size; m++) {
+          memset(&msgs[m], 0, sizeof(mmsghdr));
+          msgs[m].msg_hdr.msg_name = &addrs[m];
+          msgs[m].msg_hdr.msg_iov = &iovecs[m];
+          msgs[m].msg_hdr.msg_iovlen = 1;
+        }
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        watch(config.sockfd, EPOLLIN);
+        watch(config.shutdown_fd, EPOLLIN);
+        if(config.timer_fd >= 0) watch(config.timer_fd, EPOLLIN);
+      }
+
+      ~EpollLoop() {
+        for(buffer::Buffer *slot : slots) {
+          if(slot != nullptr) buffer::release(slot);
+        }
+        if(epoll_fd >= 0) close(epoll_fd);
+      }
+
+      const char *name() const override {
+        return backend_name(Backend::EPOLL);
+      }
+
+      void run(Handler &handler) override {
+        epoll_event events[3];
+
+        while(true) {
+          int n = epoll_wait(epoll_fd, events, 3, starved ? STARVED_WAIT_MS : -1);
+          if(n < 0) {
+            if(errno == EINTR) continue;
+            perror("epoll_wait failed");
+            return;
+          }
+
+          for(int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if(fd == config.shutdown_fd) {
+              return;
+            } else if(fd == config.timer_fd) {
+              uint64_t expirations;
+              if(read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)) handler.on_timer();
+            } else {
+              receive(handler);
+            }
+          }
+          if(starved && fill_slots() > 0) {
+            starved = false;
+            modify(config.sockfd, EPOLLIN);
+          }
+        }
+      }
+
+    private:
+      void watch(int fd, uint32_t events) {
+        epoll_event event;
+        event.events = events;
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+      }
+
+      void modify(int fd, uint32_t events) {
+        epoll_event event;
+        event.events = events;
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+      }
+
+      // gives every empty slot a buffer, returns how many leading slots have one
+      int fill_slots() {
+        int filled = 0;
+        for(; filled < config.batch_size; filled++) {
+          if(slots[filled] == nullptr && (slots[filled] = config.pool->acquire()) == nullptr) break;
+          iovecs[filled].iov_base = slots[filled]->data;
+          iovecs[filled].iov_len = config.pool->size();
+          msgs[filled].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        }
+        return filled;
+      }
+
+      void receive(Handler &handler) {
+        int available = fill_slots();
+        if(available == 0) {
+          // every buffer is still referenced by queued packets, stop watching the socket for a while
+          starved = true;
+          modify(config.sockfd, 0);
+          return;
+        }
+
+        int received = recvmmsg(config.sockfd, msgs.data(), available, MSG_DONTWAIT, nullptr);
+        if(received <= 0) return;
+
+        for(int m = 0; m < received; m++) {
+          datagrams[m].data = slots[m]->data;
+          datagrams[m].size = msgs[m].msg_len;
+          datagrams[m].addr = &addrs[m];
+          datagrams[m].buffer = slots[m];
+        }
+        handler.on_datagrams(datagrams.data(), received);
+
+        for(int m = 0; m < received; m++) {
+          buffer::release(slots[m]);
+          slots[m] = nullptr;
+        }
+      }
+
+      Config config;
+      int epoll_fd;
+      bool starved = false;
+      // buffers recvmmsg reads into, the ones not used by a call are kept for the next one
+      std::vector<buffer::Buffer*> slots;
+      std::vector<sockaddr_in> addrs;
+      std::vector<iovec> iovecs;
+      std::vector<mmsghdr> msgs;
+      std::vector<Datagram> datagrams;
+    };
+
+    // io_uring without liburing: one multishot recvmsg keeps the socket armed and the kernel
+    // picks receive buffers from a registered buffer ring, so there is no syscall per datagram.
+    class IoUringLoop : public Loop {
+      static_assert(RECV_HEADROOM >= sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in));
+
+    public:
+      static const unsigned RING_ENTRIES = 64;
+      static const uint16_t BUFFER_GROUP = 0;
+      // how long to wait for shards to give buffers back when all of them are in use
+      static const long STARVED_WAIT_NS = 1'000'000;
+
+      enum Request : uint64_t {
+        RECV = 1,
+        TIMER = 2,
+        SHUTDOWN = 3,
+        RETRY = 4
+      };
+
+      IoUringLoop(const Config &config) : config(config), datagrams(config.batch_size) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_namelen = sizeof(sockaddr_in);
+        buffer_count = config.pool->count();
+        if(buffer_count == 0 || (buffer_count & (buffer_count - 1)) != 0 || buffer_count > 32768) return;
+
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+        if(ring_fd < 0) return;
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if(single_mmap) sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if(sq_ring == MAP_FAILED) return;
+        cq_ring = single_mmap ? sq_ring : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if(cq_ring == MAP_FAILED) return;
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if(sqes == MAP_FAILED) return;
+
+        uint8_t *sq = (uint8_t*)sq_ring;
+        sq_head = (unsigned*)(sq + params.sq_off.head);
+        sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        sq_array = (unsigned*)(sq + params.sq_off.array);
+
+        uint8_t *cq = (uint8_t*)cq_ring;
+        cq_head = (unsigned*)(cq + params.cq_off.head);
+        cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+        buf_ring_size = buffer_count * sizeof(io_uring_buf);
+        buf_ring = (io_uring_buf_ring*)mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(buf_ring == MAP_FAILED) return;
+
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)buf_ring;
+        reg.ring_entries = buffer_count;
+        reg.bgid = BUFFER_GROUP;
+        if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return;
+
+        buf_tail = 0;
+        refill_buffers();
+
+        ready = true;
+      }
+
+      ~IoUringLoop() {
+        if(sqes != nullptr && sqes != MAP_FAILED) munmap(sqes, sqes_size);
+        if(cq_ring != nullptr && cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+        if(sq_ring != nullptr && sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+        if(buf_ring != nullptr && buf_ring != MAP_FAILED) munmap(buf_ring, buf_ring_size);
+        if(ring_fd >= 0) close(ring_fd);
+      }
+
+      bool ok() const { return ready; }
+
+      const char *name() const override {
+        return backend_name(Backend::IO_URING);
+      }
+
+      void run(Handler &handler) override {
+        arm_recv();
+        arm_shutdown();
+        if(config.timer_fd >= 0) arm_timer();
+
+        bool stopping = false;
+        while(!stopping) {
+          int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+          if(ret < 0) {
+            if(errno == EINTR) continue;
+            perror("io_uring_enter failed");
+            return;
+          }
+          to_submit = 0;
+
+          bool recv_stopped = false;
+          int count = 0;
+          unsigned head = *cq_head;
+          unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+          for(; head != tail; head++) {
+            io_uring_cqe *cqe = &cqes[head & cq_mask];
+            switch(cqe->user_data) {
+              case RECV: {
+                if(!(cqe->flags & IORING_CQE_F_MORE)) recv_stopped = true; // e.g. ran out of buffers
+                if(!(cqe->flags & IORING_CQE_F_BUFFER)) break;
+
+                buffer::Buffer *buffer = config.pool->get(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                kernel_buffers--;
+                if(cqe->res < 0) {
+                  buffer::release(buffer);
+                  break;
+                }
+
+                io_uring_recvmsg_out *out = (io_uring_recvmsg_out*)buffer->data;
+                uint8_t *name = buffer->data + sizeof(io_uring_recvmsg_out);
+                uint8_t *payload = name + msg.msg_namelen + msg.msg_controllen;
+                int size = std::min<int>(out->payloadlen, cqe->res - (payload - buffer->data));
+
+                datagrams[count].data = payload;
+                datagrams[count].size = size;
+                datagrams[count].addr = (sockaddr_in*)name;
+                datagrams[count].buffer = buffer;
+                count++;
+                if(count == config.batch_size) {
+                  deliver(handler, count);
+                  count = 0;
+                }
+              } break;
+              case TIMER: {
+                if(cqe->res == sizeof(timer_value)) handler.on_timer();
+                arm_timer();
+              } break;
+              case SHUTDOWN: {
+                stopping = true;
+              } break;
+              case RETRY: {
+                refill_buffers();
+                recv_stopped = true;
+              } break;
+            }
+          }
+          __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+          if(count > 0) deliver(handler, count);
+          if(recv_stopped && !stopping) {
+            // every buffer is still referenced by queued packets, look again a bit later
+            if(kernel_buffers > 0) arm_recv();
+            else arm_retry();
+          }
+        }
+      }
+
+    private:
+      void deliver(Handler &handler, int count) {
+        handler.on_datagrams(datagrams.data(), count);
+        for(int i = 0; i < count; i++) {
+          buffer::release(datagrams[i].buffer);
+        }
+        refill_buffers();
+      }
+
+      // hands every free pool buffer to the kernel
+      void refill_buffers() {
+        buffer::Buffer *buffer;
+        bool added = false;
+        while((buffer = config.pool->acquire()) != nullptr) {
+          add_buffer(buffer);
+          added = true;
+        }
+        if(added) publish_buffers();
+      }
+
+      void add_buffer(buffer::Buffer *buffer) {
+        // not buf_ring->bufs, the empty struct in __DECLARE_FLEX_ARRAY moves it by 8 bytes in C++
+        io_uring_buf *buf = (io_uring_buf*)buf_ring + (buf_tail & (buffer_count - 1));
+        buf->addr = (uint64_t)buffer->data;
+        buf->len = config.pool->size();
+        buf->bid = buffer->id;
+        buf_tail++;
+        kernel_buffers++;
+      }
+
+      void publish_buffers() {
+        __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+      }
+
+      io_uring_sqe *get_sqe() {
+        unsigned tail = *sq_tail;
+        if(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+          syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, nullptr, 0);
+          to_submit = 0;
+        }
+        unsigned index = tail & sq_mask;
+        io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(io_uring_sqe));
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        to_submit++;
+        return sqe;
+      }
+
+      void arm_recv() {
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = config.sockfd;
+        sqe->addr = (uint64_t)&msg;
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUFFER_GROUP;
+        sqe->user_data = RECV;
+      }
+
+      void arm_retry() {
+        retry_timeout.tv_sec = 0;
+        retry_timeout.tv_nsec = STARVED_WAIT_NS;
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (uint64_t)&retry_timeout;
+        sqe->len = 1;
+        sqe->user_data = RETRY;
+      }
+
+      void arm_timer() {
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = config.timer_fd;
+        sqe->addr = (uint64_t)&timer_value;
+        sqe->len = sizeof(timer_value);
+        sqe->user_data = TIMER;
+      }
+
+      void arm_shutdown() {
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = config.shutdown_fd;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = SHUTDOWN;
+      }
+
+      Config config;
+      bool ready = false;
+      int ring_fd = -1;
+      unsigned to_submit = 0;
+
+      void *sq_ring = nullptr;
+      void *cq_ring = nullptr;
+      size_t sq_ring_size = 0;
+      size_t cq_ring_size = 0;
+      io_uring_sqe *sqes = nullptr;
+      size_t sqes_size = 0;
+      unsigned *sq_head, *sq_tail, *sq_array;
+      unsigned sq_mask, sq_entries;
+      unsigned *cq_head, *cq_tail;
+      unsigned cq_mask;
+      io_uring_cqe *cqes;
+
+      io_uring_buf_ring *buf_ring = nullptr;
+      size_t buf_ring_size = 0;
+      uint16_t buf_tail;
+      unsigned buffer_count = 0;
+      unsigned kernel_buffers = 0; // pool buffers currently in the buffer ring
+
+      msghdr msg;
+      uint64_t timer_value;
+      __kernel_timespec retry_timeout;
+      std::vector<Datagram> datagrams;
+    };
+  }
+
+  std::unique_ptr<Loop> create(Backend backend, const Config &config) {
+    if(backend == Backend::IO_URING) {
+      auto loop = std::make_unique<IoUringLoop>(config);
+      if(loop->ok()) return loop;
+      logger::log(logger::EVENT_LOOP_FALLBACK, backend_name(backend), errno);
+    }
+    return std::make_unique<EpollLoop>(config);
+  }
+
+  bool parse_backend(const std::string &name, Backend &out) {
+    for(Backend backend : {Backend::EPOLL, Backend::IO_URING}) {
+      if(name != backend_name(backend)) continue;
+      out = backend;
+      return true;
+    }
+    return false;
+  }
+
+  const char *backend_name(Backend backend) {
+    switch(backend) {
+      case Backend::EPOLL: return "epoll";
+      case Backend::IO_URING: return "io_uring";
+    }
+    return "unknown";
+  }
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <netinet/in.h>
+
+#include "buffer.hpp"
+
+namespace event_loop {
+  enum Backend {
+    EPOLL = 0,
+    IO_URING = 1
+  };
+
+  // bytes the io_uring backend stores in front of every datagram (recvmsg header and address)
+  const size_t RECV_HEADROOM = 32;
+
+  struct Datagram {
+    uint8_t *data; // points into buffer
+    int size;
+    sockaddr_in *addr;
+    buffer::Buffer *buffer;
+  };
+
+  class Handler {
+  public:
+    virtual ~Handler() = default;
+    // the loop releases every buffer after the call, retain it to keep the data longer
+    virtual void on_datagrams(Datagram *datagrams, int count) = 0;
+    virtual void on_timer() = 0;
+  };
+
+  struct Config {
+    int sockfd;
+    int timer_fd; // timerfd or -1 when this loop does not run the timer
+    int shutdown_fd; // eventfd that becomes readable when the server stops
+    int batch_size; // max datagrams passed to one on_datagrams call
+    // receive buffers of max datagram size + RECV_HEADROOM, owned by the caller and only
+    // acquired from the loop's thread. The io_uring backend needs a power of two count.
+    buffer::Pool *pool;
+  };
+
+  class Loop {
+  public:
+    virtual ~Loop() = default;
+    // dispatches socket and timer events to the handler until shutdown_fd becomes readable
+    virtual void run(Handler &handler) = 0;
+    // the backend this loop runs on, which may differ from the one asked for
+    virtual const char *name() const = 0;
+  };
+
+  // falls back to epoll when io_uring can not be set up
+  std::unique_ptr<Loop> create(Backend backend, const Config &config);
+  const char *backend_name(Backend backend);
+  // the inverse of backend_name, false for unknown names
+  bool parse_backend(const std::string &name, Backend &out);
+}
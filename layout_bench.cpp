@@ -0,0 +1,201 @@
+// Time per relayed position update with the client and session layout from before the hot
+// state was split out (Client structs holding everything, sessions pointing at them) and
+// with the layout server.cpp uses now (per field arrays indexed by id, sessions holding
+// peer ids and copies of their addresses). Both are trimmed copies of the real structs,
+// keeping the fields and sizes a relay walks past.
+#include "types.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <vector>
+#include <netinet/in.h>
+
+struct Endpoint {
+  sockaddr_in addr;
+  int sockfd;
+};
+
+namespace aos {
+  struct Session;
+
+  struct Client {
+    uint16_t id;
+    Session *session;
+    bool available;
+    Endpoint addr;
+    int64_t last_msg_timestamp;
+    bool ready;
+    uint32_t score;
+    types::Vector2 pos;
+    types::Vector2 dir;
+    bool scheduled_to_disconnect;
+    Client *prev;
+    Client *next;
+    int16_t wheel_bucket;
+    uint64_t wheel_deadline;
+  };
+
+  struct Session {
+    uint16_t id;
+    bool available;
+    Client *main;
+    Client *secondary;
+    bool game_active;
+    types::Vector2 ball_pos;
+    types::Vector2 ball_dir;
+    Session *prev;
+    Session *next;
+  };
+
+  struct Layout {
+    std::unique_ptr<Client[]> clients;
+    std::unique_ptr<Session[]> sessions;
+
+    // returns the address the update goes to
+    const Endpoint *relay(uint16_t client_id, const types::Vector2 &pos, const types::Vector2 &dir) {
+      Client *client = &clients[client_id];
+      Session *session = client->session;
+      client->pos = pos;
+      client->dir = dir;
+      return &(session->main == client ? session->secondary : session->main)->addr;
+    }
+  };
+}
+
+namespace soa {
+  const uint16_t NO_CLIENT = 0xffff;
+
+  struct Motion {
+    types::Vector2 pos;
+    types::Vector2 dir;
+  };
+
+  struct alignas(64) Session {
+    uint16_t id;
+    bool available;
+    bool game_active;
+    uint16_t main;
+    uint16_t secondary;
+    Endpoint main_addr;
+    Endpoint secondary_addr;
+    types::Vector2 ball_pos;
+    types::Vector2 ball_dir;
+    Session *prev;
+    Session *next;
+    uint8_t dirty;
+  };
+
+  struct Layout {
+    std::unique_ptr<uint16_t[]> client_session;
+    std::unique_ptr<Endpoint[]> client_addr;
+    std::unique_ptr<Motion[]> client_motion;
+    std::unique_ptr<Session[]> sessions;
+
+    const Endpoint *relay(uint16_t client_id, const types::Vector2 &pos, const types::Vector2 &dir) {
+      Session *session = &sessions[client_session[client_id]];
+      client_motion[client_id] = Motion{pos, dir};
+      bool main = session->main == client_id;
+      session->dirty |= main ? 1 : 2;
+      return main ? &session->secondary_addr : &session->main_addr;
+    }
+  };
+}
+
+// pairs clients into sessions in a random order, so players of one session are rarely
+// neighbours in memory, as happens once clients come and go
+void build(size_t clients, std::vector<uint16_t> &peers, aos::Layout &aos_layout, soa::Layout &soa_layout) {
+  std::vector<uint16_t> order(clients);
+  std::iota(order.begin(), order.end(), 0);
+  std::shuffle(order.begin(), order.end(), std::mt19937(1));
+  size_t session_count = clients / 2;
+
+  aos_layout.clients = std::make_unique<aos::Client[]>(clients);
+  aos_layout.sessions = std::make_unique<aos::Session[]>(session_count);
+  soa_layout.client_session = std::make_unique<uint16_t[]>(clients);
+  soa_layout.client_addr = std::make_unique<Endpoint[]>(clients);
+  soa_layout.client_motion = std::make_unique<soa::Motion[]>(clients);
+  soa_layout.sessions = std::make_unique<soa::Session[]>(session_count);
+
+  for(size_t id = 0; id < clients; id++) {
+    Endpoint addr{};
+    addr.addr.sin_port = (uint16_t)id;
+    aos_layout.clients[id].id = (uint16_t)id;
+    aos_layout.clients[id].addr = addr;
+    soa_layout.client_addr[id] = addr;
+  }
+  peers.resize(clients);
+  for(size_t s = 0; s < session_count; s++) {
+    uint16_t main = order[s * 2], secondary = order[s * 2 + 1];
+    peers[main] = secondary;
+    peers[secondary] = main;
+
+    aos::Session &aos_session = aos_layout.sessions[s];
+    aos_session.id = (uint16_t)s;
+    aos_session.main = &aos_layout.clients[main];
+    aos_session.secondary = &aos_layout.clients[secondary];
+    aos_layout.clients[main].session = &aos_session;
+    aos_layout.clients[secondary].session = &aos_session;
+
+    soa::Session &soa_session = soa_layout.sessions[s];
+    soa_session.id = (uint16_t)s;
+    soa_session.main = main;
+    soa_session.secondary = secondary;
+    soa_session.main_addr = soa_layout.client_addr[main];
+    soa_session.secondary_addr = soa_layout.client_addr[secondary];
+    soa_layout.client_session[main] = (uint16_t)s;
+    soa_layout.client_session[secondary] = (uint16_t)s;
+  }
+}
+
+template<typename Layout>
+double ns_per_update(Layout &layout, const std::vector<uint16_t> &senders, const std::vector<uint16_t> &peers) {
+  types::Vector2 pos{1.0f, 2.0f}, dir{0.5f, -0.5f};
+  double best = 1e300;
+  for(int run = 0; run < 5; run++) {
+    uint64_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(uint16_t sender : senders) {
+      checksum += layout.relay(sender, pos, dir)->addr.sin_port;
+      pos.x += 1.0f;
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    // every update has to reach the sender's peer
+    uint64_t expected = 0;
+    for(uint16_t sender : senders) expected += peers[sender];
+    if(checksum != expected) {
+      fprintf(stderr, "relay reached the wrong peer\n");
+      exit(1);
+    }
+    best = std::min(best, elapsed / senders.size());
+  }
+  return best;
+}
+
+int main(int argc, char **argv) {
+  size_t updates = argc > 1 ? strtoul(argv[1], nullptr, 10) : 10000000;
+
+  printf("%-10s%12s%12s\n", "clients", "aos ns", "soa ns");
+  for(size_t clients : {1024, 16384, 65534}) {
+    std::vector<uint16_t> peers;
+    aos::Layout aos_layout;
+    soa::Layout soa_layout;
+    build(clients, peers, aos_layout, soa_layout);
+
+    std::mt19937 random(2);
+    std::uniform_int_distribution<uint32_t> pick(0, clients - 1);
+    std::vector<uint16_t> senders(updates);
+    for(auto &sender : senders) sender = (uint16_t)pick(random);
+
+    double aos_ns = ns_per_update(aos_layout, senders, peers);
+    double soa_ns = ns_per_update(soa_layout, senders, peers);
+    printf("%-10zu%12.2f%12.2f\n", clients, aos_ns, soa_ns);
+  }
+  printf("time per relayed update, best of 5 runs of %zu updates from random senders\n", updates);
+  return 0;
+}
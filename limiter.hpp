@@ -0,0 +1,80 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <random>
+
+// Token buckets per source address, one for every budget. A source earns tokens at the
+// budget's rate, up to one second's worth, and each packet spends one. Sources live in fixed
+// tables of two entry buckets where a new source replaces the one heard from least recently,
+// so floods from many addresses cannot grow them. A new source starts with a tenth of a
+// second's worth, so pushing a source out and back in never hands it a full bucket. Used by
+// one thread only.
+namespace limiter {
+  enum Budget : uint8_t {
+    POSITION, // position updates and snapshot acks, each one superseded by the next
+    CONTROL,
+    CONNECT, // counted per IP address, so new ports do not get a fresh budget
+    BUDGET_COUNT
+  };
+
+  class SourceLimiter {
+  public:
+    // rates in packets per second, 0 for no limit
+    void init(size_t capacity, const int (&budget_rates)[BUDGET_COUNT]) {
+      size_t count = 2;
+      while(count < capacity) count *= 2;
+      mask = count / 2 - 1;
+      // ports of one address can not push its CONNECT bucket out, that has a table of its own
+      sources = std::make_unique<Entry[]>(count);
+      addresses = std::make_unique<Entry[]>(count);
+      std::copy(budget_rates, budget_rates + BUDGET_COUNT, rates);
+      // addresses and ports come from the network, a random seed keeps them from being
+      // picked to collide
+      std::random_device random;
+      seed = ((uint64_t)random() << 32) | random();
+    }
+
+    // ip and port in network byte order, as they are in sockaddr_in
+    bool allow(uint32_t ip, uint16_t port, Budget budget, int64_t now_ns) {
+      if(rates[budget] == 0) return true;
+      Entry &entry = budget == CONNECT ? find(addresses.get(), ip, now_ns) : find(sources.get(), ((uint64_t)ip << 16) | port, now_ns);
+      if(entry.tokens[budget] < 1.0f) return false;
+      entry.tokens[budget] -= 1.0f;
+      return true;
+    }
+
+  private:
+    // a pair fills one cache line
+    struct Entry {
+      uint64_t key; // 0 while unused, no source has address and port 0
+      int64_t refilled_ns;
+      float tokens[BUDGET_COUNT];
+    };
+
+    Entry &find(Entry *table, uint64_t key, int64_t now_ns) {
+      Entry *pair = &table[(((key ^ seed) * 0x9E3779B97F4A7C15ull) >> 32 & mask) * 2];
+      Entry *entry = pair[0].key == key ? &pair[0] : pair[1].key == key ? &pair[1] : nullptr;
+      if(entry == nullptr) {
+        entry = pair[0].refilled_ns <= pair[1].refilled_ns ? &pair[0] : &pair[1];
+        entry->key = key;
+        entry->refilled_ns = now_ns;
+        for(int i = 0; i < BUDGET_COUNT; i++) entry->tokens[i] = std::max(1.0f, rates[i] * 0.1f);
+        return *entry;
+      }
+      float elapsed_s = (now_ns - entry->refilled_ns) * 1e-9f;
+      entry->refilled_ns = now_ns;
+      for(int i = 0; i < BUDGET_COUNT; i++) {
+        entry->tokens[i] = std::min<float>(rates[i], entry->tokens[i] + rates[i] * elapsed_s);
+      }
+      return *entry;
+    }
+
+    std::unique_ptr<Entry[]> sources; // keyed by address and port
+    std::unique_ptr<Entry[]> addresses; // keyed by address, only CONNECT is counted there
+    size_t mask = 0; // pairs - 1
+    uint64_t seed = 0;
+    int rates[BUDGET_COUNT] = {};
+  };
+}
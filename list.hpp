@@ -0,0 +1,31 @@
+#pragma once
+
+namespace list {
+  // Doubly linked list threaded through prev/next members of the elements themselves,
+  // so push and remove are O(1) and need no allocation. An element is in at most one
+  // list per pair of members at a time.
+  template<typename T>
+  class IntrusiveList {
+  public:
+    void push(T *item) {
+      item->prev = nullptr;
+      item->next = head;
+      if(head != nullptr) head->prev = item;
+      head = item;
+    }
+
+    void remove(T *item) {
+      if(item->prev != nullptr) item->prev->next = item->next;
+      else head = item->next;
+      if(item->next != nullptr) item->next->prev = item->prev;
+      item->prev = nullptr;
+      item->next = nullptr;
+    }
+
+    T *front() const { return head; }
+    bool empty() const { return head == nullptr; }
+
+  private:
+    T *head = nullptr;
+  };
+}
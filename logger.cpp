@@ -0,0 +1,184 @@
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+
+#include "ring.hpp"
+
+namespace logger {
+  const size_t RING_SIZE = 4096;
+  // how often the log thread looks for new records
+  const int FLUSH_INTERVAL_MS = 20;
+
+  // {} integer, {ip} IPv4 address in network byte order, {s} string, {f} double
+  const char *FORMATS[EVENT_COUNT] = {
+    "Dropped {} log records",
+    "Listening on port {} using {s}, crc: {s}",
+    "Could not set up {s} (errno {}), falling back to epoll",
+    "Client ({ip}) connected: {}",
+    "RESEND: Client ({ip}) connected: {}",
+    "Failed to connect the client",
+    "Disconnected stale client when new tried to connect on id = {}",
+    "Disconnected client (id = {})",
+    "Tried to disconnect already disconnected client (id = {})",
+    "Send info that client {} is not available.",
+    "Created session (session_id = {}) and assigned client (client_id = {}) as main.",
+    "RESEND: Created session (session_id = {}) and assigned client (client_id = {}) as main.",
+    "Failed at creating session.",
+    "Destroyed session (session_id = {})",
+    "Assigned client (client_id = {}) to session (session_id = {}) as secondary",
+    "RESEND: Assigned client (client_id = {}) to session (session_id = {}) as main",
+    "RESEND: Assigned client (client_id = {}) to session (session_id = {}) as secondary",
+    "Failed assigning client (client_id = {}) to session (session_id = {}). Client is in another session.",
+    "Failed assigning client (client_id = {}) to session (session_id = {}). Session is not used.",
+    "Failed assigning client (client_id = {}) to session (session_id = {}). Session is full.",
+    "Disconnected client (client_id = {}) from session (session_id = {})",
+    "RESEND: Disconnected client (client_id = {}) from session (session_id = {})",
+    "Client (client_id = {}) became MAIN in session (session_id = {})",
+    "Game session id = {} just started",
+    "Game session id = {} already started",
+    "Sent a reliable packet to client (client_id = {}) once without retransmission, its window and queue are full",
+    "Dropped {} stale player and {} stale ball position updates",
+    "Skipped {} position updates followed by newer ones from the same sender",
+    "Dropped {} invalid, {} unauthenticated, {} rate limited and {} shed packets"
+  };
+
+  struct ThreadLog {
+    ThreadLog() { records.init(RING_SIZE); }
+
+    ring::SpscRing<Record> records;
+    std::atomic<uint64_t> dropped = 0;
+    uint64_t reported_dropped = 0; // log thread only
+  };
+
+  std::mutex threads_mutex;
+  std::vector<std::unique_ptr<ThreadLog>> threads;
+  std::atomic<bool> running = true;
+  std::atomic<uint64_t> total_dropped = 0;
+  ring::EventCount stopped;
+
+  // registered on the first record, never freed so the log thread can always drain it
+  ThreadLog *thread_log() {
+    thread_local ThreadLog *log = nullptr;
+    if(log == nullptr) {
+      std::lock_guard<std::mutex> lock(threads_mutex);
+      threads.push_back(std::make_unique<ThreadLog>());
+      log = threads.back().get();
+    }
+    return log;
+  }
+
+  bool write(const Record &record) {
+    ThreadLog *log = thread_log();
+    Record *slot = log->records.reserve();
+    if(slot == nullptr) {
+      log->dropped.fetch_add(1, std::memory_order_relaxed);
+      total_dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    *slot = record;
+    log->records.commit();
+    log->records.publish();
+    return true;
+  }
+
+  void format(const Record &record, std::string &out) {
+    time_t seconds = record.time_ns / 1'000'000'000;
+    tm local;
+    localtime_r(&seconds, &local);
+    char time[32];
+    strftime(time, sizeof(time), "%d-%m-%Y %H-%M-%S: ", &local);
+    out += time;
+
+    int arg = 0;
+    for(const char *c = FORMATS[record.event]; *c != '\0';) {
+      if(*c != '{' || arg == MAX_ARGS) {
+        out += *c++;
+        continue;
+      }
+      uint64_t value = record.args[arg++];
+      if(strncmp(c, "{}", 2) == 0) {
+        out += std::to_string(value);
+        c += 2;
+      } else if(strncmp(c, "{ip}", 4) == 0) {
+        char ip[INET_ADDRSTRLEN];
+        in_addr addr;
+        addr.s_addr = (uint32_t)value;
+        inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+        out += ip;
+        c += 4;
+      } else if(strncmp(c, "{s}", 3) == 0) {
+        out += (const char*)(uintptr_t)value;
+        c += 3;
+      } else if(strncmp(c, "{f}", 3) == 0) {
+        out += std::to_string(std::bit_cast<double>(value));
+        c += 3;
+      } else {
+        out += *c++;
+        arg--;
+      }
+    }
+    out += '\n';
+  }
+
+  // prints everything written so far, ordered by time across threads
+  void flush(std::vector<Record> &batch, std::string &text) {
+    batch.clear();
+    {
+      std::lock_guard<std::mutex> lock(threads_mutex);
+      for(auto &log : threads) {
+        Record *record;
+        while((record = log->records.front()) != nullptr) {
+          batch.push_back(*record);
+          log->records.pop();
+        }
+        uint64_t dropped = log->dropped.load(std::memory_order_relaxed);
+        if(dropped != log->reported_dropped) {
+          int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+          batch.push_back(Record{now, LOG_RECORDS_DROPPED, {dropped - log->reported_dropped}});
+          log->reported_dropped = dropped;
+        }
+      }
+    }
+    if(batch.empty()) return;
+
+    std::stable_sort(batch.begin(), batch.end(), [](const Record &a, const Record &b) { return a.time_ns < b.time_ns; });
+    text.clear();
+    for(const Record &record : batch) {
+      format(record, text);
+    }
+    std::cout << text;
+  }
+
+  void run() {
+    std::vector<Record> batch;
+    std::string text;
+    while(running.load(std::memory_order_acquire)) {
+      uint32_t key = stopped.prepare_wait();
+      if(!running.load(std::memory_order_acquire)) {
+        stopped.cancel_wait();
+        break;
+      }
+      stopped.wait(key, FLUSH_INTERVAL_MS);
+      flush(batch, text);
+    }
+    flush(batch, text);
+    std::cout.flush();
+  }
+
+  void stop() {
+    running.store(false, std::memory_order_release);
+    stopped.notify();
+  }
+
+  uint64_t dropped() {
+    return total_dropped.load(std::memory_order_relaxed);
+  }
+}
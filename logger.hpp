@@ -0,0 +1,80 @@
+#pragma once
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <type_traits>
+
+// Every thread writes fixed size records (time, event id, integer arguments) into its own
+// ring. Only the thread running logger::run turns them into text, so logging never
+// formats, allocates or locks on the caller's side. A full ring drops the record.
+namespace logger {
+  // the text of every event lives in logger.cpp, keep both lists in the same order
+  enum Event : uint16_t {
+    LOG_RECORDS_DROPPED,
+    LISTENING,
+    EVENT_LOOP_FALLBACK,
+    CLIENT_CONNECTED,
+    CLIENT_CONNECTED_RESEND,
+    CONNECT_FAILED,
+    STALE_CLIENT_REPLACED,
+    CLIENT_DISCONNECTED,
+    CLIENT_ALREADY_DISCONNECTED,
+    CLIENT_NOT_AVAILABLE,
+    SESSION_CREATED,
+    SESSION_CREATED_RESEND,
+    SESSION_CREATE_FAILED,
+    SESSION_DESTROYED,
+    ASSIGNED_AS_SECONDARY,
+    ASSIGNED_AS_MAIN_RESEND,
+    ASSIGNED_AS_SECONDARY_RESEND,
+    ASSIGN_FAILED_OTHER_SESSION,
+    ASSIGN_FAILED_SESSION_NOT_USED,
+    ASSIGN_FAILED_SESSION_FULL,
+    LEFT_SESSION,
+    LEFT_SESSION_RESEND,
+    BECAME_MAIN,
+    GAME_STARTED,
+    GAME_ALREADY_STARTED,
+    RELIABLE_OVERFLOW,
+    STALE_UPDATES_DROPPED,
+    UPDATES_COALESCED,
+    PACKETS_DROPPED,
+    EVENT_COUNT
+  };
+
+  const int MAX_ARGS = 4;
+
+  struct Record {
+    int64_t time_ns; // system clock
+    Event event;
+    uint64_t args[MAX_ARGS];
+  };
+
+  // strings passed as arguments must outlive the log thread (literals, static names)
+  template<typename T>
+  uint64_t to_arg(T value) {
+    if constexpr(std::is_floating_point_v<T>) return std::bit_cast<uint64_t>((double)value);
+    else if constexpr(std::is_pointer_v<T>) return (uint64_t)(uintptr_t)value;
+    else return (uint64_t)value;
+  }
+
+  // returns false when the record was dropped because the thread's ring is full
+  bool write(const Record &record);
+
+  template<typename... Args>
+  void log(Event event, Args... args) {
+    static_assert(sizeof...(Args) <= MAX_ARGS);
+    Record record{
+      std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count(),
+      event,
+      {to_arg(args)...}
+    };
+    write(record);
+  }
+
+  // formats and prints records until stop() is called, then prints what is left
+  void run();
+  void stop();
+  uint64_t dropped();
+}
@@ -0,0 +1,172 @@
+#include "metrics.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace metrics {
+  struct Description {
+    const char *name;
+    const char *type;
+    const char *labels; // fixed labels, "" for none
+    const char *help;
+  };
+
+  const Description DESCRIPTIONS[FAMILY_COUNT] = {
+    {"pong_recv_batches_total", "counter", "", "Receive calls that returned datagrams."},
+    {"pong_datagrams_received_total", "counter", "", "Datagrams received."},
+    {"pong_crc_failures_total", "counter", "", "Packets skipped because their CRC did not match."},
+    {"pong_packets_received_total", "counter", "", "Packets with a valid CRC, by type."},
+    {"pong_packets_dropped_total", "counter", "reason=\"invalid\"", "Packets that never reached a handler, by reason and type."},
+    {"pong_packets_dropped_total", "counter", "reason=\"unauthenticated\"", ""},
+    {"pong_packets_dropped_total", "counter", "reason=\"rate_limited\"", ""},
+    {"pong_packets_dropped_total", "counter", "reason=\"shed\"", ""},
+    {"pong_position_updates_skipped_total", "counter", "reason=\"stale_player\"", "Position updates that were not applied, by reason."},
+    {"pong_position_updates_skipped_total", "counter", "reason=\"stale_ball\"", ""},
+    {"pong_position_updates_skipped_total", "counter", "reason=\"coalesced\"", ""},
+    {"pong_datagrams_sent_total", "counter", "", "Datagrams sent."},
+    {"pong_reliable_overflows_total", "counter", "", "Reliable control packets sent once without retransmission because the window and queue of the client were full."},
+    {"pong_clients_stale_total", "counter", "", "Clients that sent nothing for stale_time."},
+    {"pong_stale_disconnects_total", "counter", "", "Stale clients disconnected to make room for new ones."},
+    {"pong_active_clients", "gauge", "", "Connected clients."},
+    {"pong_active_sessions", "gauge", "", "Sessions in use."},
+    {"pong_active_games", "gauge", "", "Sessions with a game in progress."},
+    {"pong_processing_latency_seconds", "histogram", "", "Time from receiving a packet to handling it."}
+  };
+
+  std::mutex threads_mutex;
+  std::vector<std::unique_ptr<std::atomic<uint64_t>[]>> threads;
+
+  std::atomic<uint64_t> *register_thread() {
+    std::lock_guard<std::mutex> lock(threads_mutex);
+    threads.push_back(std::make_unique<std::atomic<uint64_t>[]>(SLOT_COUNT));
+    return threads.back().get();
+  }
+
+  void sum_threads(std::vector<uint64_t> &sums) {
+    sums.assign(SLOT_COUNT, 0);
+    std::lock_guard<std::mutex> lock(threads_mutex);
+    for(auto &slots : threads) {
+      for(int i = 0; i < SLOT_COUNT; i++) {
+        sums[i] += slots[i].load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  uint64_t total(Family family) {
+    std::vector<uint64_t> sums;
+    sum_threads(sums);
+    uint64_t value = 0;
+    for(int i = OFFSETS[family]; i < OFFSETS[family + 1]; i++) {
+      value += sums[i];
+    }
+    return value;
+  }
+
+  std::string join_labels(const char *fixed, const std::string &more) {
+    if(*fixed == '\0') return more;
+    if(more.empty()) return fixed;
+    return std::string(fixed) + "," + more;
+  }
+
+  // cumulative buckets with the bound in seconds, as Prometheus expects
+  void render_histogram(std::string &out, const Description &description, const uint64_t *values) {
+    std::string bucket = std::string(description.name) + "_bucket";
+    uint64_t count = 0;
+    char bound[32];
+    for(int i = 0; i <= LATENCY_BUCKETS; i++) {
+      count += values[i];
+      if(i < LATENCY_BUCKETS) snprintf(bound, sizeof(bound), "le=\"%g\"", (double)((uint64_t)1 << i) * 1e-6);
+      else snprintf(bound, sizeof(bound), "le=\"+Inf\"");
+      render_sample(out, bucket.c_str(), join_labels(description.labels, bound), count);
+    }
+    render_sample(out, (std::string(description.name) + "_sum").c_str(), description.labels, values[LATENCY_BUCKETS + 1] * 1e-9);
+    render_sample(out, (std::string(description.name) + "_count").c_str(), description.labels, count);
+  }
+
+  void render(std::string &out) {
+    std::vector<uint64_t> sums;
+    sum_threads(sums);
+    for(int family = 0; family < FAMILY_COUNT; family++) {
+      const Description &description = DESCRIPTIONS[family];
+      // families sharing a name differ only in their fixed labels
+      if(family == 0 || strcmp(description.name, DESCRIPTIONS[family - 1].name) != 0) {
+        render_header(out, description.name, description.type, description.help);
+      }
+      const uint64_t *values = &sums[OFFSETS[family]];
+      if(per_type((Family)family)) {
+        // types nobody sent are left out
+        for(int type = 0; type < PACKET_TYPES; type++) {
+          if(values[type] == 0) continue;
+          render_sample(out, description.name, join_labels(description.labels, "type=\"" + std::to_string(type) + "\""), values[type]);
+        }
+      } else if(family == PROCESSING_LATENCY) {
+        render_histogram(out, description, values);
+      } else if(strcmp(description.type, "gauge") == 0) {
+        render_sample(out, description.name, description.labels, (int64_t)values[0]);
+      } else {
+        render_sample(out, description.name, description.labels, values[0]);
+      }
+    }
+  }
+
+  void render_header(std::string &out, const char *name, const char *type, const char *help) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+  }
+
+  void render_sample(std::string &out, const char *name, const std::string &labels, double value) {
+    out += name;
+    if(!labels.empty()) {
+      out += '{';
+      out += labels;
+      out += '}';
+    }
+    // whole numbers up to 15 digits print without an exponent
+    char text[32];
+    snprintf(text, sizeof(text), " %.15g\n", value);
+    out += text;
+  }
+
+  void serve(int listen_fd, int shutdown_fd, void (*collect)(std::string &out)) {
+    std::string text;
+    pollfd fds[2] = {{listen_fd, POLLIN, 0}, {shutdown_fd, POLLIN, 0}};
+    while(true) {
+      if(poll(fds, 2, -1) < 0) {
+        if(errno == EINTR) continue;
+        perror("metrics poll failed");
+        return;
+      }
+      if(fds[1].revents != 0) return;
+      if(!(fds[0].revents & POLLIN)) continue;
+
+      int connection = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+      if(connection < 0) continue;
+      text.clear();
+      collect(text);
+      // a reader that stops reading holds this thread up for the timeout at most
+      timeval timeout{1, 0};
+      setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+      for(size_t sent = 0; sent < text.size();) {
+        ssize_t n = send(connection, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+        if(n <= 0) break;
+        sent += n;
+      }
+      close(connection);
+    }
+  }
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Counters, gauges and histograms kept per thread. Every thread adds to its own block of
+// slots, so recording is a load and a store to memory no other thread writes. Reading sums
+// the blocks of all threads, exact once the writers are quiet and close enough while they
+// run. render() prints the sums in the Prometheus text format.
+namespace metrics {
+  // the names and help texts live in metrics.cpp, keep both lists in the same order
+  enum Family : uint8_t {
+    RECV_BATCHES,
+    DATAGRAMS_RECEIVED,
+    CRC_FAILURES,
+    PACKETS_RECEIVED,
+    DROPPED_INVALID,
+    DROPPED_UNAUTHENTICATED,
+    DROPPED_RATE_LIMITED,
+    DROPPED_SHED,
+    STALE_PLAYER_UPDATES,
+    STALE_BALL_UPDATES,
+    COALESCED_UPDATES,
+    DATAGRAMS_SENT,
+    RELIABLE_OVERFLOWS,
+    CLIENTS_STALE,
+    STALE_DISCONNECTS,
+    ACTIVE_CLIENTS,
+    ACTIVE_SESSIONS,
+    ACTIVE_GAMES,
+    PROCESSING_LATENCY,
+    FAMILY_COUNT
+  };
+
+  // families counted per packet type have one slot for every type byte
+  const int PACKET_TYPES = 256;
+  // latency buckets are powers of two microseconds, 1us up to about 8s, then +Inf
+  const int LATENCY_BUCKETS = 24;
+
+  constexpr bool per_type(Family family) {
+    return family == PACKETS_RECEIVED || (family >= DROPPED_INVALID && family <= DROPPED_SHED);
+  }
+
+  constexpr int family_size(Family family) {
+    if(per_type(family)) return PACKET_TYPES;
+    if(family == PROCESSING_LATENCY) return LATENCY_BUCKETS + 2; // buckets, +Inf and the sum
+    return 1;
+  }
+
+  // where every family starts in a thread's block, the last entry is the block size
+  constexpr std::array<int, FAMILY_COUNT + 1> OFFSETS = [] {
+    std::array<int, FAMILY_COUNT + 1> offsets{};
+    for(int i = 0; i < FAMILY_COUNT; i++) {
+      offsets[i + 1] = offsets[i] + family_size((Family)i);
+    }
+    return offsets;
+  }();
+  const int SLOT_COUNT = OFFSETS[FAMILY_COUNT];
+
+  // the calling thread's block, registered on first use and never freed
+  std::atomic<uint64_t> *register_thread();
+  inline thread_local std::atomic<uint64_t> *local_slots = nullptr;
+
+  inline void add(int slot, uint64_t value) {
+    if(local_slots == nullptr) local_slots = register_thread();
+    std::atomic<uint64_t> &target = local_slots[slot];
+    target.store(target.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+  }
+
+  inline void count(Family family, uint64_t value = 1) {
+    add(OFFSETS[family], value);
+  }
+
+  inline void count_type(Family family, uint8_t type, uint64_t value = 1) {
+    add(OFFSETS[family] + type, value);
+  }
+
+  // gauges are the sum of every thread's changes, so one thread alone may go below zero
+  inline void change(Family family, int64_t delta) {
+    add(OFFSETS[family], (uint64_t)delta);
+  }
+
+  inline void observe(Family family, int64_t value_ns) {
+    uint64_t us = value_ns > 0 ? (value_ns + 999) / 1000 : 0;
+    int bucket = std::min<int>(std::bit_width(us > 0 ? us - 1 : 0), LATENCY_BUCKETS);
+    add(OFFSETS[family] + bucket, 1);
+    add(OFFSETS[family] + LATENCY_BUCKETS + 1, value_ns > 0 ? value_ns : 0);
+  }
+
+  // sum over all threads and, for families counted per type, all types
+  uint64_t total(Family family);
+
+  void render(std::string &out);
+  // for values the caller samples itself, like queue depths
+  void render_header(std::string &out, const char *name, const char *type, const char *help);
+  void render_sample(std::string &out, const char *name, const std::string &labels, double value);
+
+  // writes a fresh snapshot from collect to every connection accepted on listen_fd, until
+  // shutdown_fd becomes readable
+  void serve(int listen_fd, int shutdown_fd, void (*collect)(std::string &out));
+}
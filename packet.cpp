@@ -1,186 +1,115 @@
 #include "packet.hpp"
+#include "crc.hpp"
+
+#include <algorithm>
+#include <bit>
 
 namespace packet {
   uint16_t crc16_mcrf4xx(uint16_t crc, uint8_t *data, size_t len)
   {
-    if (!data || len < 0) return crc;
-
-    while (len--) {
-      crc ^= *data++;
-      for (int i=0; i<8; i++) {
-        if (crc & 1)  crc = (crc >> 1) ^ 0x8408;
-        else          crc = (crc >> 1);
-      }
-    }
-    return crc;
+    return crc::update(crc, data, len);
   }
 
   uint16_t crc16(uint8_t *data, size_t len) {
     return crc16_mcrf4xx(CRC_VAL, data, len);
   }
 
-  void make_packet(SendData *packet, PacketType type, uint8_t *data, uint16_t size) {
-    memcpy(packet->data, PREAMBLE, PREAMBLE_SIZE);
-    packet->data[3] = type;
-    memcpy(&packet->data[4], &size, sizeof(size));
-    memcpy(&packet->data[6], data, size);
-    uint16_t crc = crc16(packet->data, PREAMBLE_SIZE + 3 + size);
-    memcpy(&packet->data[6 + size], &crc, sizeof(crc));
-    packet->size = PREAMBLE_SIZE + sizeof(uint8_t) + sizeof(uint16_t) + size + sizeof(uint16_t);
-  }
-
-  void make_connected_packet(SendData *packet, uint16_t client_id) {
-    make_packet(
-      packet,
-      PacketType::CONNECTED,
-      (uint8_t*)&client_id,
-      sizeof(uint16_t)
-    );
-  }
-
-  void make_could_not_connect_packet(SendData *packet) {
-    make_packet(
-      packet,
-      PacketType::COULD_NOT_CONNECT,
-      nullptr,
-      0
-    );
-  }
-
-  void make_disconnected_packet(SendData *packet) {
-    make_packet(
-      packet,
-      PacketType::DISCONNECTED,
-      nullptr,
-      0
-    );
-  }
-
-  void make_assigned_to_session_packet(SendData *packet, uint16_t session_id, uint16_t client_id, ClientType type) {
-    uint8_t data[5];
-    memcpy(data, reinterpret_cast<uint8_t*>(&session_id), sizeof(uint16_t));
-    memcpy(&data[2], reinterpret_cast<uint8_t*>(&client_id), sizeof(uint16_t));
-    data[4] = (uint8_t)type;
-    make_packet(
-      packet,
-      PacketType::ASSIGNED_TO_SESSION,
-      data,
-      5
-    );
+  uint16_t finish_packet(uint8_t *out, PacketType type, uint16_t size) {
+    memcpy(out, PREAMBLE, PREAMBLE_SIZE);
+    out[PREAMBLE_SIZE] = type;
+    memcpy(&out[PREAMBLE_SIZE + 1], &size, sizeof(size));
+    uint16_t crc = crc16(out, HEADER_SIZE + size);
+    memcpy(&out[HEADER_SIZE + size], &crc, sizeof(crc));
+    return HEADER_SIZE + size + sizeof(uint16_t);
   }
 
-  void make_could_not_create_session_packet(SendData *packet) {
-    make_packet(
-      packet,
-      PacketType::COULD_NOT_CREATE_SESSION,
-      nullptr,
-      0
-    );
-  }
+  bool parse_packet(uint8_t *buffer, int size, int &pos, Packet &packet, int &crc_failures) {
+    for(; pos + MIN_PACKET_SIZE <= size; pos++) {
+      if(memcmp(&buffer[pos], PREAMBLE, PREAMBLE_SIZE) != 0) continue;
 
-  void make_session_disconnect_status_packet(SendData *packet, uint16_t session_id, uint16_t client_id, SessionDisconnectStatus status) {
-    uint8_t data[5];
-    memcpy(data, reinterpret_cast<uint8_t*>(&session_id), sizeof(uint16_t));
-    memcpy(&data[2], reinterpret_cast<uint8_t*>(&client_id), sizeof(uint16_t));
-    data[4] = (uint8_t)status;
-    make_packet(
-      packet,
-      PacketType::SESSION_DISCONNECT_STATUS,
-      data,
-      5
-    );
-  }
+      uint16_t data_size;
+      memcpy(&data_size, &buffer[pos + PREAMBLE_SIZE + 1], sizeof(data_size));
+      int packet_size = MIN_PACKET_SIZE + data_size;
+      if(pos + packet_size > size) continue;
 
-  void make_could_not_assign_to_session_packet(SendData *packet, uint16_t session_id) {
-    make_packet(
-      packet,
-      PacketType::COULD_NOT_ASSIGN_TO_SESSION,
-      reinterpret_cast<uint8_t*>(&session_id),
-      sizeof(uint16_t)
-    );
-  }
+      uint16_t crc;
+      memcpy(&crc, &buffer[pos + HEADER_SIZE + data_size], sizeof(crc));
+      if(crc16(&buffer[pos], HEADER_SIZE + data_size) != crc) {
+        crc_failures++;
+        continue;
+      }
 
-  void make_inform_client_ready_packet(SendData *packet, uint16_t session_id, uint16_t client_id, Readiness readiness) {
-    uint8_t data[5];
-    memcpy(data, reinterpret_cast<uint8_t*>(&session_id), sizeof(uint16_t));
-    memcpy(&data[2], reinterpret_cast<uint8_t*>(&client_id), sizeof(uint16_t));
-    data[4] = (uint8_t)readiness;
-    make_packet(
-      packet,
-      PacketType::INFORM_CLIENT_READY,
-      data,
-      5
-    );
+      packet.type = buffer[pos + PREAMBLE_SIZE];
+      packet.size = data_size;
+      packet.data = &buffer[pos + HEADER_SIZE];
+      pos += packet_size;
+      return true;
+    }
+    pos = size;
+    return false;
   }
 
-  void make_game_started_packet(SendData *packet, uint16_t session_id) {
-    make_packet(
-      packet,
-      PacketType::GAME_STARTED,
-      reinterpret_cast<uint8_t*>(&session_id),
-      sizeof(uint16_t)
-    );
+  void encode_snapshot(SendData *packet, const Snapshot &snapshot) {
+    encode<SESSION_SNAPSHOT>(packet, snapshot.seq,
+      snapshot.ball_pos, snapshot.ball_dir,
+      snapshot.main_pos, snapshot.main_dir,
+      snapshot.secondary_pos, snapshot.secondary_dir);
   }
 
-  void make_inform_ball_pos_packet(SendData *packet, types::Vector2 ball_pos, types::Vector2 ball_dir) {
-    uint8_t data[12 * 2];
-    types::encode_vec2(ball_pos, &data[0]);
-    types::encode_vec2(ball_dir, &data[12]);
-    make_packet(
-      packet,
-      PacketType::INFORM_BALL_POS,
-      data,
-      12 * 2
-    );
+  void quantize_snapshot(const Snapshot &snapshot, const SnapshotRanges &ranges, QuantizedSnapshot &out) {
+    types::Vector2 vectors[] = {snapshot.ball_pos, snapshot.ball_dir, snapshot.main_pos, snapshot.main_dir, snapshot.secondary_pos, snapshot.secondary_dir};
+    out.seq = snapshot.seq;
+    for(int i = 0; i < SNAPSHOT_VALUES / 2; i++) {
+      bool position = i % 2 == 0;
+      out.values[i * 2] = types::quantize(vectors[i].x, position ? ranges.x : ranges.direction);
+      out.values[i * 2 + 1] = types::quantize(vectors[i].y, position ? ranges.y : ranges.direction);
+    }
   }
 
-  void make_inform_player_pos_packet(SendData *packet, uint16_t client_id, types::Vector2 player_pos, types::Vector2 player_dir) {
-    const int size = 2 + 12 * 2;
-    uint8_t data[size];
-    memcpy(data, reinterpret_cast<uint8_t*>(&client_id), sizeof(uint16_t));
-    types::encode_vec2(player_pos, &data[2]);
-    types::encode_vec2(player_dir, &data[2 + 12]);
-    make_packet(
-      packet,
-      PacketType::INFORM_PLAYER_POS,
-      data,
-      size
-    );
-  }
+  // Bit i of changed is set for every value that differs from the base. Their deltas, modulo
+  // 2^16 and zigzag encoded so small steps either way stay small, follow in order, each
+  // bits wide and packed least significant bit first.
+  void encode_compact_snapshot(SendData *packet, const QuantizedSnapshot &snapshot, const QuantizedSnapshot *base) {
+    using Header = Schema<COMPACT_SNAPSHOT>;
+    uint16_t deltas[SNAPSHOT_VALUES];
+    uint16_t changed = 0;
+    int count = 0;
+    int bits = 0;
+    for(int i = 0; i < SNAPSHOT_VALUES; i++) {
+      int16_t delta = (int16_t)(snapshot.values[i] - (base != nullptr ? base->values[i] : 0));
+      if(delta == 0) continue;
+      uint16_t zigzag = (uint16_t)((delta << 1) ^ (delta >> 15));
+      changed |= 1 << i;
+      deltas[count++] = zigzag;
+      bits = std::max<int>(bits, std::bit_width(zigzag));
+    }
 
-  void make_inform_point_scored_packet(SendData *packet, uint16_t session_id, uint32_t main_score, uint32_t secondary_score, uint16_t client_id) {
-    const int size = 2 + 4 + 4 + 2;
-    uint8_t data[size];
-    memcpy(data, reinterpret_cast<uint8_t*>(&session_id), sizeof(uint16_t));
-    memcpy(&data[2], reinterpret_cast<uint8_t*>(&main_score), sizeof(uint32_t));
-    memcpy(&data[6], reinterpret_cast<uint8_t*>(&secondary_score), sizeof(uint32_t));
-    memcpy(&data[10], reinterpret_cast<uint8_t*>(&client_id), sizeof(uint16_t));
-    make_packet(
-      packet,
-      PacketType::INFORM_POINT_SCORED,
-      data,
-      size
-    );
+    uint8_t *data = &packet->data[HEADER_SIZE];
+    Header::encode(data, snapshot.seq, base != nullptr ? base->seq : 0, changed, (uint8_t)bits);
+    uint16_t size = Header::SIZE;
+    uint32_t pending = 0;
+    int pending_bits = 0;
+    for(int i = 0; i < count; i++) {
+      pending |= (uint32_t)deltas[i] << pending_bits;
+      pending_bits += bits;
+      for(; pending_bits >= 8; pending_bits -= 8) {
+        data[size++] = pending & 0xff;
+        pending >>= 8;
+      }
+    }
+    if(pending_bits > 0) data[size++] = pending;
+    packet->size = finish_packet(packet->data, COMPACT_SNAPSHOT, size);
   }
 
-  void make_inform_player_won_packet(SendData *packet, uint16_t session_id, uint16_t client_id) {
-    const int size = 2 + 2;
-    uint8_t data[size];
-    memcpy(data, reinterpret_cast<uint8_t*>(&session_id), sizeof(uint16_t));
-    memcpy(&data[2], reinterpret_cast<uint8_t*>(&client_id), sizeof(uint16_t));
-    make_packet(
-      packet,
-      PacketType::INFORM_WON,
-      data,
-      size
-    );
+  void wrap_reliable(SendData *packet, uint16_t client_id, uint32_t seq, const SendData &inner) {
+    using Header = Schema<RELIABLE>;
+    Header::encode(&packet->data[HEADER_SIZE], client_id, seq);
+    memcpy(&packet->data[HEADER_SIZE + Header::SIZE], inner.data, inner.size);
+    packet->size = finish_packet(packet->data, RELIABLE, Header::SIZE + inner.size);
   }
 
   bool verify_packet(Packet &packet) {
-    return packet.size == packet_data_size[packet.type];
-  }
-
-  uint16_t get_id_from_packet(Packet &packet, uint16_t offset) {
-    return *reinterpret_cast<uint16_t*>(&packet.data[offset]);
+    uint16_t size = packet_data_size[packet.type];
+    return packet.size == size || packet.size == packet_extended_size[packet.type] || (packet_variable_size[packet.type] && packet.size > size);
   }
-}
\ No newline at end of file
+}
@@ -6,9 +6,10 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <cstring>
-#include <map>
 
 #include "types.hpp"
+#include "buffer.hpp"
+#include "schema.hpp"
 
 namespace packet {
   const int MAX_PACKET_SIZE = 512;
@@ -17,12 +18,19 @@ namespace packet {
   const int PREAMBLE_SIZE = 3;
   const int CRC_VAL = 0xffff;
 
+  const int HEADER_SIZE = PREAMBLE_SIZE + sizeof(uint8_t) + sizeof(uint16_t);
+
+  // A validated packet inside a receive buffer. Whoever stores the view holds a reference
+  // on the buffer and releases it when done with the packet.
   struct Packet {
     sockaddr_in clientaddr;
+    int sockfd;
+    uint16_t sender; // client the source address belongs to, 0xffff for none
     uint8_t type;
     uint16_t size;
-    uint8_t data[MAX_PACKET_SIZE - MIN_PACKET_SIZE];
-    uint16_t crc;
+    uint8_t *data;
+    buffer::Buffer *buffer;
+    int64_t received_ns; // steady clock, when the listener got the datagram
   };
 
   enum PacketType {
@@ -48,33 +56,12 @@ namespace packet {
     INFORM_POINT_SCORED = 19,
     INFORM_WON = 20,
     IM_ALIVE = 21,
-    DISCONNECTED = 22
-  };
-
-  static std::map<uint8_t, uint16_t> packet_data_size {
-    { CONNECT, 0 },
-    { CONNECTED, 2 },
-    { COULD_NOT_CONNECT, 2 },
-    { DISCONNECT, 2 },
-    { CREATE_SESSION, 2 },
-    { ASSIGNED_TO_SESSION, 5 },
-    { COULD_NOT_CREATE_SESSION, 0 },
-    { INFORM_CLIENT_READY, 5 },
-    { ASSIGN_TO_SESSION, 4 },
-    { COULD_NOT_ASSIGN_TO_SESSION, 2 },
-    { DISCONNECT_FROM_SESSION, 4 },
-    { SESSION_DISCONNECT_STATUS, 5 },
-    { SET_READY, 5 },
-    { GAME_STARTED, 2 },
-    { SET_BALL_POS, 26 },
-    { INFORM_BALL_POS, 24 },
-    { SET_PLAYER_POS, 26 },
-    { INFORM_PLAYER_POS, 26 },
-    { POINT_SCORED, 4 },
-    { INFORM_POINT_SCORED, 12 },
-    { INFORM_WON, 4 },
-    { IM_ALIVE, 0 },
-    { DISCONNECTED, 0 }
+    DISCONNECTED = 22,
+    SESSION_SNAPSHOT = 23,
+    COMPACT_SNAPSHOT = 24,
+    SNAPSHOT_ACK = 25,
+    RELIABLE = 26,
+    ACK = 27
   };
 
   enum ClientType {
@@ -92,6 +79,15 @@ namespace packet {
     NOT_READY = 0
   };
 
+  // optional features a client asks for in the extended CONNECT. The extended CONNECTED
+  // answers with the ones the server turned on.
+  enum Capability : uint8_t {
+    SESSION_SNAPSHOTS = 1 << 0,
+    COMPACT_SNAPSHOTS = 1 << 1,
+    RELIABLE_CONTROL = 1 << 2,
+    PACKED_DATAGRAMS = 1 << 3 // the client reads every packet of a datagram, not just the first
+  };
+
   struct SendData {
     uint8_t data[MAX_PACKET_SIZE];
     uint16_t size;
@@ -99,23 +95,202 @@ namespace packet {
 
   uint16_t crc16_mcrf4xx(uint16_t crc, uint8_t *data, size_t len);
   uint16_t crc16(uint8_t *data, size_t len);
-  
-  void make_packet(SendData *packet, PacketType type, uint8_t *data, uint16_t size);
-  void make_connected_packet(SendData *packet, uint16_t client_id);
-  void make_could_not_connect_packet(SendData *packet);
-  void make_disconnected_packet(SendData *packet);
-  void make_assigned_to_session_packet(SendData *packet, uint16_t session_id, uint16_t client_id, ClientType type);
-  void make_could_not_create_session_packet(SendData *packet);
-  void make_session_disconnect_status_packet(SendData *packet, uint16_t session_id, uint16_t client_id, SessionDisconnectStatus status);
-  void make_could_not_assign_to_session_packet(SendData *packet, uint16_t session_id);
-  void make_inform_client_ready_packet(SendData *packet, uint16_t session_id, uint16_t client_id, Readiness readiness);
-  void make_game_started_packet(SendData *packet, uint16_t session_id);
-  void make_inform_ball_pos_packet(SendData *packet, types::Vector2 ball_pos, types::Vector2 ball_dir);
-  void make_inform_player_pos_packet(SendData *packet, uint16_t client_id, types::Vector2 player_pos, types::Vector2 player_dir);
-  void make_inform_point_scored_packet(SendData *packet, uint16_t session_id, uint32_t main_score, uint32_t secondary_score, uint16_t client_id);
-  void make_inform_player_won_packet(SendData *packet, uint16_t session_id, uint16_t client_id);
 
+  // data of every packet type, field by field (see dokumentacja.md). Packets that gained
+  // optional trailing fields also list all of them as Extended, both forms are valid.
+  template<PacketType Type> struct Schema;
+  template<> struct Schema<CONNECT> : Fields<> {
+    using Extended = Fields<Capability>; // capabilities
+  };
+  template<> struct Schema<CONNECTED> : Fields<uint16_t> { // client_id
+    using Extended = Fields<uint16_t, Capability>; // client_id, capabilities
+  };
+  template<> struct Schema<COULD_NOT_CONNECT> : Fields<> {};
+  template<> struct Schema<DISCONNECT> : Fields<uint16_t> {}; // client_id
+  template<> struct Schema<CREATE_SESSION> : Fields<uint16_t> {}; // client_id
+  template<> struct Schema<ASSIGNED_TO_SESSION> : Fields<uint16_t, uint16_t, ClientType> {}; // session_id, client_id, type
+  template<> struct Schema<COULD_NOT_CREATE_SESSION> : Fields<> {};
+  template<> struct Schema<INFORM_CLIENT_READY> : Fields<uint16_t, uint16_t, Readiness> {}; // session_id, client_id, readiness
+  template<> struct Schema<ASSIGN_TO_SESSION> : Fields<uint16_t, uint16_t> {}; // client_id, session_id
+  template<> struct Schema<COULD_NOT_ASSIGN_TO_SESSION> : Fields<uint16_t> {}; // session_id
+  template<> struct Schema<DISCONNECT_FROM_SESSION> : Fields<uint16_t, uint16_t> {}; // session_id, client_id
+  template<> struct Schema<SESSION_DISCONNECT_STATUS> : Fields<uint16_t, uint16_t, SessionDisconnectStatus> {}; // session_id, client_id, status
+  template<> struct Schema<SET_READY> : Fields<uint16_t, uint16_t, Readiness> {}; // client_id, session_id, readiness
+  template<> struct Schema<GAME_STARTED> : Fields<uint16_t> {}; // session_id
+  template<> struct Schema<SET_BALL_POS> : Fields<uint16_t, types::Vector2, types::Vector2> { // session_id, ball_pos, ball_dir
+    using Extended = Fields<uint16_t, types::Vector2, types::Vector2, uint32_t>; // session_id, ball_pos, ball_dir, seq
+  };
+  template<> struct Schema<INFORM_BALL_POS> : Fields<types::Vector2, types::Vector2> {}; // ball_pos, ball_dir
+  template<> struct Schema<SET_PLAYER_POS> : Fields<uint16_t, types::Vector2, types::Vector2> { // client_id, pos, dir
+    using Extended = Fields<uint16_t, types::Vector2, types::Vector2, uint32_t>; // client_id, pos, dir, seq
+  };
+  template<> struct Schema<INFORM_PLAYER_POS> : Fields<uint16_t, types::Vector2, types::Vector2> {}; // client_id, pos, dir
+  template<> struct Schema<POINT_SCORED> : Fields<uint16_t, uint16_t> {}; // session_id, client_id
+  template<> struct Schema<INFORM_POINT_SCORED> : Fields<uint16_t, uint32_t, uint32_t, uint16_t> {}; // session_id, main_score, secondary_score, client_id
+  template<> struct Schema<INFORM_WON> : Fields<uint16_t, uint16_t> {}; // session_id, client_id
+  template<> struct Schema<IM_ALIVE> : Fields<uint16_t> {}; // client_id
+  template<> struct Schema<DISCONNECTED> : Fields<> {};
+  // seq, ball_pos, ball_dir, main_pos, main_dir, secondary_pos, secondary_dir
+  template<> struct Schema<SESSION_SNAPSHOT> : Fields<uint32_t, PlainVector2, PlainVector2, PlainVector2, PlainVector2, PlainVector2, PlainVector2> {};
+
+  // seq, base_seq, changed, bits, followed by the packed deltas (see encode_compact_snapshot)
+  template<> struct Schema<COMPACT_SNAPSHOT> : Fields<uint32_t, uint32_t, uint16_t, uint8_t> {
+    static const bool VARIABLE = true;
+  };
+  template<> struct Schema<SNAPSHOT_ACK> : Fields<uint16_t, uint32_t> {}; // client_id, seq
+
+  // client_id, seq, followed by a whole control packet (see wrap_reliable)
+  template<> struct Schema<RELIABLE> : Fields<uint16_t, uint32_t> {
+    static const bool VARIABLE = true;
+  };
+  template<> struct Schema<ACK> : Fields<uint16_t, uint32_t> {}; // client_id, seq
+
+  const int PACKET_TYPE_COUNT = ACK + 1;
+
+  // no packet has this much data, so unknown types never pass verify_packet
+  const uint16_t INVALID_SIZE = 0xffff;
+
+  template<PacketType Type, typename = void>
+  struct ExtendedSize {
+    static const uint16_t SIZE = INVALID_SIZE;
+  };
+
+  template<PacketType Type>
+  struct ExtendedSize<Type, std::void_t<typename Schema<Type>::Extended>> {
+    static const uint16_t SIZE = Schema<Type>::Extended::SIZE;
+  };
+
+  template<size_t... I>
+  constexpr std::array<uint16_t, PACKET_TYPE_COUNT> make_data_sizes(std::index_sequence<I...>) {
+    return {Schema<static_cast<PacketType>(I)>::SIZE...};
+  }
+
+  template<size_t... I>
+  constexpr std::array<uint16_t, PACKET_TYPE_COUNT> make_extended_sizes(std::index_sequence<I...>) {
+    return {ExtendedSize<static_cast<PacketType>(I)>::SIZE...};
+  }
+
+  template<size_t... I>
+  constexpr std::array<bool, PACKET_TYPE_COUNT> make_variable_sizes(std::index_sequence<I...>) {
+    return {Schema<static_cast<PacketType>(I)>::VARIABLE...};
+  }
+
+  // indexed by the raw type byte, so the lookup needs no bounds check
+  constexpr std::array<uint16_t, 256> packet_data_size = [] {
+    std::array<uint16_t, 256> sizes;
+    sizes.fill(INVALID_SIZE);
+    auto known = make_data_sizes(std::make_index_sequence<PACKET_TYPE_COUNT>());
+    for(int type = 0; type < PACKET_TYPE_COUNT; type++) sizes[type] = known[type];
+    return sizes;
+  }();
+
+  // size of the extended form, INVALID_SIZE for types without one
+  constexpr std::array<uint16_t, 256> packet_extended_size = [] {
+    std::array<uint16_t, 256> sizes;
+    sizes.fill(INVALID_SIZE);
+    auto known = make_extended_sizes(std::make_index_sequence<PACKET_TYPE_COUNT>());
+    for(int type = 0; type < PACKET_TYPE_COUNT; type++) sizes[type] = known[type];
+    return sizes;
+  }();
+
+  // packets that may carry more data than packet_data_size
+  constexpr std::array<bool, 256> packet_variable_size = [] {
+    std::array<bool, 256> variable;
+    variable.fill(false);
+    auto known = make_variable_sizes(std::make_index_sequence<PACKET_TYPE_COUNT>());
+    for(int type = 0; type < PACKET_TYPE_COUNT; type++) variable[type] = known[type];
+    return variable;
+  }();
+
+  // writes preamble, type, size and crc around data already encoded at out[HEADER_SIZE],
+  // returns the size of the whole packet
+  uint16_t finish_packet(uint8_t *out, PacketType type, uint16_t size);
+
+  // adds a packet after the ones already in the datagram, the caller makes sure it fits.
+  // Arguments follow the type's schema.
+  template<PacketType Type, typename... Args>
+  void append(SendData *packet, Args &&...args) {
+    uint8_t *out = &packet->data[packet->size];
+    Schema<Type>::encode(&out[HEADER_SIZE], std::forward<Args>(args)...);
+    packet->size += finish_packet(out, Type, Schema<Type>::SIZE);
+  }
+
+  // builds a datagram holding just this packet
+  template<PacketType Type, typename... Args>
+  void encode(SendData *packet, Args &&...args) {
+    packet->size = 0;
+    append<Type>(packet, std::forward<Args>(args)...);
+  }
+
+  // the extended form of a packet that has one
+  template<PacketType Type, typename... Args>
+  void encode_extended(SendData *packet, Args &&...args) {
+    using Extended = typename Schema<Type>::Extended;
+    Extended::encode(&packet->data[HEADER_SIZE], std::forward<Args>(args)...);
+    packet->size = finish_packet(packet->data, Type, Extended::SIZE);
+  }
+
+  // all fields of a verified packet as a tuple
+  template<PacketType Type>
+  typename Schema<Type>::Values decode(Packet &packet) {
+    return Schema<Type>::decode(packet.data);
+  }
+
+  inline bool is_extended(const Packet &packet) {
+    return packet.size == packet_extended_size[packet.type];
+  }
+
+  // all fields of a verified packet for which is_extended is true
+  template<PacketType Type>
+  typename Schema<Type>::Extended::Values decode_extended(Packet &packet) {
+    return Schema<Type>::Extended::decode(packet.data);
+  }
+
+  // latest state of a session, all of it in one SESSION_SNAPSHOT
+  struct Snapshot {
+    uint32_t seq;
+    types::Vector2 ball_pos;
+    types::Vector2 ball_dir;
+    types::Vector2 main_pos;
+    types::Vector2 main_dir;
+    types::Vector2 secondary_pos;
+    types::Vector2 secondary_dir;
+  };
+
+  void encode_snapshot(SendData *packet, const Snapshot &snapshot);
+
+  // ball_pos, ball_dir, main_pos, main_dir, secondary_pos, secondary_dir, x before y
+  const int SNAPSHOT_VALUES = 12;
+
+  // bounds of the playing field for positions, directions share one range for both axes
+  struct SnapshotRanges {
+    types::Range x;
+    types::Range y;
+    types::Range direction;
+  };
+
+  // a Snapshot with every value quantized, what COMPACT_SNAPSHOT deltas are taken between
+  struct QuantizedSnapshot {
+    uint32_t seq; // 0 for none
+    uint16_t values[SNAPSHOT_VALUES];
+  };
+
+  void quantize_snapshot(const Snapshot &snapshot, const SnapshotRanges &ranges, QuantizedSnapshot &out);
+  // base is a snapshot the player acknowledged, nullptr takes the deltas against zeros
+  void encode_compact_snapshot(SendData *packet, const QuantizedSnapshot &snapshot, const QuantizedSnapshot *base);
+
+  // puts the datagram inner (one finished packet) into a RELIABLE packet
+  void wrap_reliable(SendData *packet, uint16_t client_id, uint32_t seq, const SendData &inner);
+
+  // a single field of a verified packet
+  template<PacketType Type, size_t I>
+  auto get(Packet &packet) {
+    return Schema<Type>::template get<I>(packet.data);
+  }
+
+  // finds the next packet with a valid crc in buffer starting at pos and moves pos past it.
+  // Garbage in front of a preamble is skipped. Only type, size and data are filled in.
+  // Complete packets skipped for a crc mismatch are added to crc_failures.
+  bool parse_packet(uint8_t *buffer, int size, int &pos, Packet &packet, int &crc_failures);
   bool verify_packet(Packet &packet);
-  
-  uint16_t get_id_from_packet(Packet &packet, uint16_t offset);
 }
\ No newline at end of file
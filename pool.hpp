@@ -0,0 +1,95 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sys/mman.h>
+
+namespace pool {
+  const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+  // Slots allocated in fixed size chunks as they are needed, up to a capacity set at
+  // init. Chunks never move, so pointers to slots stay valid for the pool's lifetime and
+  // finding a slot by index costs one extra load.
+  template<typename T>
+  class ChunkedPool {
+  public:
+    ~ChunkedPool() {
+      for(size_t i = 0; i < chunk_count; i++) {
+        T *chunk = chunks[i].load(std::memory_order_relaxed);
+        if(chunk == nullptr) break;
+        std::destroy_n(chunk, chunk_size);
+        munmap(chunk, chunk_bytes);
+      }
+    }
+
+    // chunk_size is rounded up to a power of two. With huge_pages the chunks come from
+    // reserved huge pages when there are any, otherwise transparent huge pages are asked for.
+    void init(size_t capacity, size_t chunk_size, bool huge_pages) {
+      chunk_bits = 0;
+      while(((size_t)1 << chunk_bits) < chunk_size) chunk_bits++;
+      this->chunk_size = (size_t)1 << chunk_bits;
+      this->huge_pages = huge_pages;
+      max_size = capacity;
+      chunk_bytes = this->chunk_size * sizeof(T);
+      if(huge_pages) chunk_bytes = (chunk_bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+      chunk_count = (capacity + this->chunk_size - 1) >> chunk_bits;
+      chunks = std::make_unique<std::atomic<T*>[]>(chunk_count);
+    }
+
+    // Adds the next chunk. init_slot(index, slot) runs for each of its slots, from the
+    // highest index down, before they become visible through size(). Returns false at
+    // capacity or when the memory could not be mapped. Any thread may grow the pool.
+    template<typename F>
+    bool grow(F init_slot) {
+      std::lock_guard<std::mutex> lock(grow_mutex);
+      size_t first = allocated.load(std::memory_order_relaxed);
+      if(first >= max_size) return false;
+
+      T *chunk = map_chunk();
+      if(chunk == nullptr) return false;
+      std::uninitialized_value_construct_n(chunk, chunk_size);
+      chunks[first >> chunk_bits].store(chunk, std::memory_order_release);
+
+      size_t end = std::min(first + chunk_size, max_size);
+      for(size_t index = end; index-- > first;) {
+        init_slot(index, chunk[index - first]);
+      }
+      allocated.store(end, std::memory_order_release);
+      return true;
+    }
+
+    // only for indices below size(), or ones received from a thread that checked it
+    T &operator[](size_t index) {
+      return chunks[index >> chunk_bits].load(std::memory_order_relaxed)[index & (chunk_size - 1)];
+    }
+
+    // slots below this index are allocated and initialized
+    size_t size() const { return allocated.load(std::memory_order_acquire); }
+    size_t capacity() const { return max_size; }
+
+  private:
+    T *map_chunk() {
+      void *memory = MAP_FAILED;
+      if(huge_pages) memory = mmap(nullptr, chunk_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if(memory == MAP_FAILED) {
+        memory = mmap(nullptr, chunk_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(memory == MAP_FAILED) return nullptr;
+        if(huge_pages) madvise(memory, chunk_bytes, MADV_HUGEPAGE);
+      }
+      return (T*)memory;
+    }
+
+    std::unique_ptr<std::atomic<T*>[]> chunks;
+    size_t chunk_count = 0;
+    size_t chunk_bits = 0;
+    size_t chunk_size = 1;
+    size_t chunk_bytes = 0;
+    size_t max_size = 0;
+    bool huge_pages = false;
+    std::atomic<size_t> allocated = 0;
+    std::mutex grow_mutex;
+  };
+}
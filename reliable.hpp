@@ -0,0 +1,162 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+// Acknowledged delivery for control packets. Every reliable packet carries a sequence
+// number starting at 1. The receiver acks each one and drops repeats with a sliding
+// window, the sender keeps what is not acked yet and sends it again when its
+// retransmission timeout passes. The timeout follows the measured round trip time the
+// way TCP does it (RFC 6298), with only first transmissions sampled. Packets sent while
+// the window is full wait in a queue and go out as acks make room.
+namespace reliable {
+  const int WINDOW = 8; // unacked packets per peer
+  const int QUEUE = 8; // packets per peer waiting for room in the window
+  const int MAX_PACKET_SIZE = 48; // whole wrapped control packets, position packets never go here
+  const int MAX_RETRIES = 8;
+  const int64_t INITIAL_RTO_NS = 250'000'000;
+  const int64_t MIN_RTO_NS = 50'000'000;
+  const int64_t MAX_RTO_NS = 3'000'000'000;
+
+  struct Pending {
+    uint32_t seq;
+    uint16_t size;
+    uint8_t retries;
+    int64_t sent_ns; // first transmission
+    int64_t deadline_ns;
+    uint8_t data[MAX_PACKET_SIZE];
+  };
+
+  struct RttEstimator {
+    int64_t srtt_ns = 0; // 0 until the first sample
+    int64_t rttvar_ns = 0;
+    int64_t rto_ns = INITIAL_RTO_NS;
+
+    void sample(int64_t rtt_ns) {
+      if(srtt_ns == 0) {
+        srtt_ns = rtt_ns;
+        rttvar_ns = rtt_ns / 2;
+      } else {
+        int64_t error = rtt_ns - srtt_ns;
+        rttvar_ns += (std::abs(error) - rttvar_ns) / 4;
+        srtt_ns += error / 8;
+      }
+      rto_ns = std::clamp(srtt_ns + 4 * rttvar_ns, MIN_RTO_NS, MAX_RTO_NS);
+    }
+  };
+
+  // which of the last 64 sequence numbers arrived, compared with wraparound
+  struct ReceiveWindow {
+    uint32_t newest = 0; // 0 before the first packet
+    uint64_t seen = 0; // bit i set when newest - i arrived
+
+    // true the first time seq shows up. Anything older than the window counts as a repeat.
+    bool accept(uint32_t seq) {
+      if(seq == 0) return false;
+      int32_t ahead = (int32_t)(seq - newest);
+      if(newest == 0 || ahead > 0) {
+        seen = newest == 0 || ahead >= 64 ? 1 : (seen << ahead) | 1;
+        newest = seq;
+        return true;
+      }
+      uint32_t behind = -ahead;
+      if(behind >= 64 || (seen & ((uint64_t)1 << behind))) return false;
+      seen |= (uint64_t)1 << behind;
+      return true;
+    }
+  };
+
+  // both directions of reliable traffic with one peer
+  struct Channel {
+    uint32_t next_seq = 1;
+    ReceiveWindow received;
+    RttEstimator rtt;
+    int pending_count = 0;
+    Pending pending[WINDOW];
+    // in seq order, starting at queued[queued_first]
+    int queued_count = 0;
+    int queued_first = 0;
+    Pending queued[QUEUE];
+
+    void reset() {
+      next_seq = 1;
+      received = ReceiveWindow();
+      rtt = RttEstimator();
+      pending_count = 0;
+      queued_count = 0;
+      queued_first = 0;
+    }
+
+    // whether a packet can be sent right away. Not while others are queued, it would
+    // overtake them.
+    bool has_room() const {
+      return pending_count < WINDOW && queued_count == 0;
+    }
+
+    // keeps a sent packet until it is acked, false when the window is full or it is too big
+    bool add(uint32_t seq, const uint8_t *data, uint16_t size, int64_t now_ns) {
+      if(pending_count == WINDOW || size > MAX_PACKET_SIZE) return false;
+      Pending &entry = pending[pending_count++];
+      entry.seq = seq;
+      entry.size = size;
+      entry.retries = 0;
+      entry.sent_ns = now_ns;
+      entry.deadline_ns = now_ns + rtt.rto_ns;
+      std::copy(data, data + size, entry.data);
+      return true;
+    }
+
+    // keeps a packet that does not fit the window yet, false when the queue is full too
+    bool enqueue(uint32_t seq, const uint8_t *data, uint16_t size) {
+      if(queued_count == QUEUE || size > MAX_PACKET_SIZE) return false;
+      Pending &entry = queued[(queued_first + queued_count++) % QUEUE];
+      entry.seq = seq;
+      entry.size = size;
+      std::copy(data, data + size, entry.data);
+      return true;
+    }
+
+    // moves queued packets into the window while it has room, calling send(entry) for the
+    // first transmission of each
+    template<typename F>
+    void promote(int64_t now_ns, F send) {
+      while(queued_count > 0 && pending_count < WINDOW) {
+        Pending &entry = queued[queued_first];
+        queued_first = (queued_first + 1) % QUEUE;
+        queued_count--;
+        add(entry.seq, entry.data, entry.size, now_ns);
+        send(pending[pending_count - 1]);
+      }
+    }
+
+    // false for acks of packets that are not pending (repeated acks)
+    bool acknowledge(uint32_t seq, int64_t now_ns) {
+      for(int i = 0; i < pending_count; i++) {
+        if(pending[i].seq != seq) continue;
+        if(pending[i].retries == 0) rtt.sample(now_ns - pending[i].sent_ns);
+        pending[i] = pending[--pending_count];
+        return true;
+      }
+      return false;
+    }
+
+    // calls resend(entry) for every packet whose timeout passed, backing the timeout off
+    // each time. Packets out of retries are given up on, the peer is likely gone.
+    template<typename F>
+    void retransmit(int64_t now_ns, F resend) {
+      for(int i = 0; i < pending_count;) {
+        Pending &entry = pending[i];
+        if(entry.deadline_ns > now_ns) {
+          i++;
+        } else if(entry.retries == MAX_RETRIES) {
+          entry = pending[--pending_count];
+        } else {
+          entry.retries++;
+          entry.deadline_ns = now_ns + std::min(rtt.rto_ns << entry.retries, MAX_RTO_NS);
+          resend(entry);
+          i++;
+        }
+      }
+    }
+  };
+}
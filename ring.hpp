@@ -0,0 +1,145 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <ctime>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+namespace ring {
+  const size_t CACHE_LINE_SIZE = 64;
+  const int SPIN_COUNT = 2000;
+
+  inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+
+  // Lets a consumer sleep on a futex until a producer publishes something.
+  // Producers only pay for a fence and a load unless somebody actually sleeps.
+  class EventCount {
+  public:
+    uint32_t prepare_wait() {
+      waiters.fetch_add(1, std::memory_order_seq_cst);
+      return epoch.load(std::memory_order_seq_cst);
+    }
+
+    void cancel_wait() {
+      waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // returns after notify() or when timeout_ms passes (-1 waits forever)
+    void wait(uint32_t key, int timeout_ms = -1) {
+      timespec timeout;
+      timeout.tv_sec = timeout_ms / 1000;
+      timeout.tv_nsec = (long)(timeout_ms % 1000) * 1'000'000;
+      syscall(SYS_futex, &epoch, FUTEX_WAIT_PRIVATE, key, timeout_ms < 0 ? nullptr : &timeout, nullptr, 0);
+      waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void notify() {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if(waiters.load(std::memory_order_relaxed) == 0) return;
+      epoch.fetch_add(1, std::memory_order_seq_cst);
+      syscall(SYS_futex, &epoch, FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+    }
+
+  private:
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> epoch = 0;
+    std::atomic<uint32_t> waiters = 0;
+  };
+
+  // Bounded single-producer/single-consumer queue that keeps elements in place.
+  // The producer fills slots with reserve()/commit() and makes them visible to the
+  // consumer in one go with publish(). The consumer reads with front()/pop().
+  // The capacity is set once with init() before either side uses the ring.
+  template<typename T>
+  class SpscRing {
+  public:
+    void init(size_t capacity) {
+      slot_count = capacity + 1;
+      slots = std::make_unique<T[]>(slot_count);
+    }
+
+    // producer side
+    T *reserve() {
+      size_t next = advance(pending_tail);
+      if(next == cached_head) {
+        cached_head = head.load(std::memory_order_acquire);
+        if(next == cached_head) return nullptr;
+      }
+      return &slots[pending_tail];
+    }
+
+    void commit() {
+      pending_tail = advance(pending_tail);
+    }
+
+    // counts everything committed and not popped yet. The consumer's position is only read
+    // again when the last one seen says there are more than count.
+    bool more_than(size_t count) {
+      if(distance(cached_head, pending_tail) <= count) return false;
+      cached_head = head.load(std::memory_order_acquire);
+      return distance(cached_head, pending_tail) > count;
+    }
+
+    // returns false when there was nothing new to publish
+    bool publish() {
+      if(tail.load(std::memory_order_relaxed) == pending_tail) return false;
+      tail.store(pending_tail, std::memory_order_release);
+      return true;
+    }
+
+    // consumer side
+    T *front() {
+      if(current_head == cached_tail) {
+        cached_tail = tail.load(std::memory_order_acquire);
+        if(current_head == cached_tail) return nullptr;
+      }
+      return &slots[current_head];
+    }
+
+    void pop() {
+      current_head = advance(current_head);
+      head.store(current_head, std::memory_order_release);
+    }
+
+    // approximate when called from a thread other than the consumer
+    size_t size() const {
+      size_t t = tail.load(std::memory_order_acquire);
+      size_t h = head.load(std::memory_order_acquire);
+      return distance(h, t);
+    }
+
+    size_t capacity() const { return slot_count - 1; }
+
+  private:
+    size_t advance(size_t index) const {
+      return index + 1 == slot_count ? 0 : index + 1;
+    }
+
+    size_t distance(size_t from, size_t to) const {
+      return to >= from ? to - from : to + slot_count - from;
+    }
+
+    // set by init, read by both sides. One slot always stays empty to tell a full ring
+    // from an empty one.
+    alignas(CACHE_LINE_SIZE) std::unique_ptr<T[]> slots;
+    size_t slot_count = 1;
+
+    // written by the consumer
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head = 0;
+    size_t current_head = 0;
+    size_t cached_tail = 0;
+
+    // written by the producer
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail = 0;
+    size_t pending_tail = 0;
+    size_t cached_head = 0;
+  };
+}
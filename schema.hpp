@@ -0,0 +1,132 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "types.hpp"
+
+// Compile-time description of every packet's data. Each packet type lists its fields,
+// sizes and offsets follow from the list, and the encoders/decoders generated from it read
+// and write the packet buffers directly.
+namespace packet {
+  // wire format of a single field
+  template<typename T, typename = void>
+  struct Field;
+
+  template<typename T>
+  struct Field<T, std::enable_if_t<std::is_integral_v<T>>> {
+    static const uint16_t SIZE = sizeof(T);
+    static void encode(T value, uint8_t *out) { memcpy(out, &value, SIZE); }
+    static T decode(const uint8_t *in) {
+      T value;
+      memcpy(&value, in, SIZE);
+      return value;
+    }
+  };
+
+  template<>
+  struct Field<float> {
+    static const uint16_t SIZE = 4;
+    static void encode(float value, uint8_t *out) { memcpy(out, &value, SIZE); }
+    static float decode(const uint8_t *in) {
+      float value;
+      memcpy(&value, in, SIZE);
+      return value;
+    }
+  };
+
+  // enums travel as one byte
+  template<typename T>
+  struct Field<T, std::enable_if_t<std::is_enum_v<T>>> {
+    static const uint16_t SIZE = 1;
+    static void encode(T value, uint8_t *out) { *out = (uint8_t)value; }
+    static T decode(const uint8_t *in) { return static_cast<T>(*in); }
+  };
+
+  // [type:4][x:4][y:4], see types::encode_vec2
+  template<>
+  struct Field<types::Vector2> {
+    static const uint16_t SIZE = 12;
+    static void encode(types::Vector2 value, uint8_t *out) {
+      int32_t type = types::VECTOR2;
+      memcpy(out, &type, sizeof(type));
+      memcpy(&out[4], &value.x, sizeof(float));
+      memcpy(&out[8], &value.y, sizeof(float));
+    }
+    static types::Vector2 decode(const uint8_t *in) {
+      types::Vector2 value;
+      memcpy(&value.x, &in[4], sizeof(float));
+      memcpy(&value.y, &in[8], sizeof(float));
+      return value;
+    }
+  };
+
+  // Vector2 without the variant tag, for packets only this server's clients decode
+  struct PlainVector2 {
+    float x;
+    float y;
+
+    PlainVector2() = default;
+    PlainVector2(types::Vector2 value) : x(value.x), y(value.y) {}
+    operator types::Vector2() const { return types::Vector2{x, y}; }
+  };
+
+  // [x:4][y:4]
+  template<>
+  struct Field<PlainVector2> {
+    static const uint16_t SIZE = 8;
+    static void encode(PlainVector2 value, uint8_t *out) {
+      Field<float>::encode(value.x, out);
+      Field<float>::encode(value.y, &out[4]);
+    }
+    static PlainVector2 decode(const uint8_t *in) {
+      PlainVector2 value;
+      value.x = Field<float>::decode(in);
+      value.y = Field<float>::decode(&in[4]);
+      return value;
+    }
+  };
+
+  template<typename... Ts>
+  struct Fields {
+    using Values = std::tuple<Ts...>;
+    static const size_t COUNT = sizeof...(Ts);
+    static const uint16_t SIZE = (0 + ... + Field<Ts>::SIZE);
+    // set by packets whose fields are only a header followed by SIZE or more bytes
+    static const bool VARIABLE = false;
+
+    static constexpr std::array<uint16_t, COUNT + 1> OFFSETS = [] {
+      std::array<uint16_t, COUNT + 1> offsets = {};
+      uint16_t sizes[] = {Field<Ts>::SIZE..., 0};
+      for(size_t i = 0; i < COUNT; i++) offsets[i + 1] = offsets[i] + sizes[i];
+      return offsets;
+    }();
+
+    static void encode(uint8_t *out, const Ts &...values) {
+      encode_all(out, std::index_sequence_for<Ts...>(), values...);
+    }
+
+    static Values decode(const uint8_t *in) {
+      return decode_all(in, std::index_sequence_for<Ts...>());
+    }
+
+    template<size_t I>
+    static std::tuple_element_t<I, Values> get(const uint8_t *in) {
+      return Field<std::tuple_element_t<I, Values>>::decode(&in[OFFSETS[I]]);
+    }
+
+  private:
+    template<size_t... I>
+    static void encode_all([[maybe_unused]] uint8_t *out, std::index_sequence<I...>, const Ts &...values) {
+      (Field<Ts>::encode(values, &out[OFFSETS[I]]), ...);
+    }
+
+    template<size_t... I>
+    static Values decode_all(const uint8_t *in, std::index_sequence<I...>) {
+      return Values(Field<Ts>::decode(&in[OFFSETS[I]])...);
+    }
+  };
+}
@@ -8,470 +8,1376 @@
 #include <poll.h>
 #include <thread>
 #include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <algorithm>
-#include <semaphore.h>
 #include <mutex>
 #include <queue>
-#include <iomanip>
 #include <ctime>
-#include <sstream>
+#include <atomic>
+#include <array>
+#include <memory>
+#include <vector>
+#include <pthread.h>
+#include <csignal>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 
 #include "types.hpp"
 #include "packet.hpp"
-
-const int PORT = 8080;
-
-const int MAIN_LOOP_DELAY_MS = 1000;
-const int MAIN_LOOP_DELAY_US = MAIN_LOOP_DELAY_MS * 1000;
-
-const int CLIENT_COUNT = 1024;
-const int SESSION_COUNT = CLIENT_COUNT / 2;
-
-const float MAX_STALE_TIME_S = 10.0;
-
-const int MAX_PACKET_COUNT = 100'000;
+#include "crc.hpp"
+#include "ring.hpp"
+#include "event_loop.hpp"
+#include "logger.hpp"
+#include "list.hpp"
+#include "wheel.hpp"
+#include "pool.hpp"
+#include "config.hpp"
+#include "reliable.hpp"
+#include "address_index.hpp"
+#include "limiter.hpp"
+#include "metrics.hpp"
+
+const int STALE_CHECK_INTERVAL_MS = 100;
+// how often shards with unacked control packets look for ones to send again
+const int RETRANSMIT_CHECK_INTERVAL_MS = 10;
+
+// every shard is one processing thread owning a disjoint part of clients and sessions
+const int SHARD_COUNT = 4;
+
+const int RECV_BATCH_SIZE = 64;
+// receive buffers per listener (power of two for io_uring). Parsed packets point into them,
+// so this also bounds how many datagrams can wait in the shard rings.
+const int RECV_BUFFER_COUNT = 8192;
+const int SEND_BATCH_SIZE = 64;
+
+// sources each listener keeps rate limits for, the least recent ones make room for new ones
+const int RATE_LIMITED_SOURCES = 16384;
+// how full a shard's position ring may get before position updates headed to it are dropped
+const int SHED_FILL_PERCENT = 75;
+// share of the ring space given to control rings. Control traffic is light and always
+// handled first, so it needs less room than positions.
+const int CONTROL_LANE_PERCENT = 25;
+// hash slots for finding the newest position update per sender in a batch
+const int COALESCE_SLOTS = RECV_BATCH_SIZE * 2;
 
 const int POINTS_TO_WIN = 10;
 
-int sockfd;
+// quantized snapshots kept per session for compact snapshot deltas, acks older than this
+// get a whole snapshot again
+const int SNAPSHOT_HISTORY = 32;
+
+// port, pool capacities and timeouts, see config.hpp
+config::Config settings;
+// stale clients are found with a timing wheel ticking once per stale check
+uint64_t stale_timeout_ticks;
+// time between position broadcasts, zero when every processing pass relays what changed
+std::chrono::nanoseconds broadcast_interval{0};
+// what an extended CONNECT can turn on, snapshots only exist in tick mode
+uint8_t supported_capabilities = packet::RELIABLE_CONTROL | packet::PACKED_DATAGRAMS;
+// compact snapshot quantization, from the field bounds in the settings
+packet::SnapshotRanges snapshot_ranges;
+
+int sockfds[config::MAX_LISTENERS];
 sockaddr_in servaddr;
-bool server_running = true;
-sem_t full_space;
-sem_t free_space;
-std::mutex packet_mutex;
-std::mutex send_mutex;
-
-std::mutex log_mutex;
-std::queue<std::string> logs;
-sem_t logs_available;
+std::atomic<bool> server_running = true;
+int shutdown_fd; // eventfd written once to stop every event loop
+int stale_check_fd; // timerfd driving stale client checks
+
+int metrics_fd = -1; // listening unix socket for metrics::serve, -1 when not configured
+
+// why a received packet never reached its handler, each one a metrics family
+enum DropReason {
+  DROP_INVALID = metrics::DROPPED_INVALID, // failed verification or a type clients do not send
+  DROP_UNAUTHENTICATED = metrics::DROPPED_UNAUTHENTICATED, // see authenticate
+  DROP_RATE_LIMITED = metrics::DROPPED_RATE_LIMITED, // the source ran out of its budget, see limiter.hpp
+  DROP_SHED = metrics::DROPPED_SHED // a position update while its shard was falling behind, see route_packet
+};
 
-typedef std::chrono::time_point<std::chrono::system_clock> timestamp;
 typedef std::lock_guard<std::mutex> lock_guard;
 
-struct Session;
+// where a client is reached: its address and the socket its traffic arrives on, so replies
+// leave through the same socket and NAT mappings keep working
+struct Endpoint {
+  sockaddr_in addr;
+  int sockfd;
+};
+
+const uint16_t NO_CLIENT = 0xffff;
+const uint16_t NO_SESSION = 0xffff;
 
+// what changes on connect, session changes and expiry. The state relays touch on every
+// packet is kept apart, in the client_* arrays below.
 struct Client {
   uint16_t id;
-  Session *session;
   bool available;
-  sockaddr_in addr;
-  timestamp last_msg_timestamp;
   bool ready;
+  bool scheduled_to_disconnect;
+  uint8_t capabilities; // packet::Capability agreed on connect
   uint32_t score;
+  uint32_t position_seq; // newest SET_PLAYER_POS seq applied, 0 for none
+  // links in the owning shard's free list (available), stale list (scheduled_to_disconnect)
+  // or expiry wheel (everything else)
+  Client *prev;
+  Client *next;
+  int16_t wheel_bucket;
+  uint64_t wheel_deadline;
+  int8_t retransmit_shard; // shard whose retransmit list has the client, -1 for none
+  reliable::Channel channel; // used with RELIABLE_CONTROL
+};
+
+enum SessionChanges : uint8_t {
+  MAIN_MOVED = 1 << 0,
+  SECONDARY_MOVED = 1 << 1,
+  BALL_MOVED = 1 << 2
+};
+
+struct Motion {
   types::Vector2 pos;
   types::Vector2 dir;
-  bool scheduled_to_disconnect;
 };
 
-struct Session {
+// everything a relay reads fits in the first cache line: the players, copies of their
+// addresses so sending to a peer never touches its client, and the ball
+struct alignas(ring::CACHE_LINE_SIZE) Session {
   uint16_t id;
   bool available;
-  Client *main;
-  Client *secondary;
   bool game_active;
+  uint16_t main; // NO_CLIENT when the place is free
+  uint16_t secondary;
+  Endpoint main_addr;
+  Endpoint secondary_addr;
   types::Vector2 ball_pos;
   types::Vector2 ball_dir;
+  // links in the owning shard's free list while available, or its dirty list while dirty
+  Session *prev;
+  Session *next;
+  uint8_t dirty; // SessionChanges since the last broadcast
+  uint8_t main_capabilities;
+  uint8_t secondary_capabilities;
+  uint32_t snapshot_seq; // keeps counting when the session is reused, 0 is never sent
+  uint32_t ball_seq; // newest SET_BALL_POS seq applied from the current main, 0 for none
+  // newest snapshot each player acknowledged since joining, 0 for none
+  uint32_t main_acked;
+  uint32_t secondary_acked;
+  packet::QuantizedSnapshot history[SNAPSHOT_HISTORY]; // indexed by seq % SNAPSHOT_HISTORY
+};
+static_assert(offsetof(Session, prev) == ring::CACHE_LINE_SIZE);
+
+// grown a chunk at a time by the shard that runs out of free slots, up to the configured
+// counts. Ids at or above size() are not allocated yet.
+pool::ChunkedPool<Client> clients;
+pool::ChunkedPool<Session> sessions;
+
+// shard that currently owns the client or session, sized for the full capacity. Sessions
+// stay with the shard that allocated them, clients move to the shard of the session they join.
+std::unique_ptr<std::atomic<uint8_t>[]> client_owner;
+std::unique_ptr<std::atomic<uint8_t>[]> session_owner;
+
+// hot client state, one array per field group indexed by client id. They are sized for the
+// full capacity but left uninitialized, so pages are only touched once their ids are in use.
+std::unique_ptr<uint16_t[]> client_session; // NO_SESSION when not in one
+std::unique_ptr<Endpoint[]> client_addr;
+std::unique_ptr<Motion[]> client_motion;
+// who sent a packet, by its source address. Maintained by connect_client and disconnect_client.
+address_index::AddressIndex client_index;
+
+struct OutboundPacket {
+  Endpoint addr;
+  packet::SendData packet;
+};
+
+struct Shard {
+  int id;
+  // two lanes per listen thread: control packets, always handled first, and position
+  // updates (budget limiter::POSITION), which are coalesced and shed under load
+  // only the first settings.listeners are used
+  ring::SpscRing<packet::Packet> control[config::MAX_LISTENERS];
+  ring::SpscRing<packet::Packet> positions[config::MAX_LISTENERS];
+  // filled by other shards when a packet has to follow its client (cross-shard handoff)
+  std::mutex handoff_mutex;
+  std::queue<packet::Packet> handoff;
+  std::atomic<uint32_t> handoff_pending = 0;
+  std::atomic<bool> stale_check_requested = false;
+  // set when creating a session found no free slot, cleared when one is destroyed
+  std::atomic<bool> out_of_sessions = false;
+  ring::EventCount work_available;
+
+  // slots owned by this shard, so allocating one never scans
+  list::IntrusiveList<Client> free_clients;
+  list::IntrusiveList<Client> stale_clients;
+  list::IntrusiveList<Session> free_sessions;
+  // clients in use and not stale yet, by the tick they become stale
+  wheel::TimingWheel<Client> client_expiry;
+  // sessions with positions changed since the last broadcast
+  list::IntrusiveList<Session> dirty_sessions;
+  std::chrono::steady_clock::time_point next_broadcast;
+  // clients with control packets waiting for an ack
+  std::vector<uint16_t> retransmit_clients;
+  std::chrono::steady_clock::time_point next_retransmit_check;
+
+  // only the shard's own thread sends, so the outbound queue is not locked
+  OutboundPacket outbound[SEND_BATCH_SIZE];
+  int outbound_count = 0;
 };
 
-Client clients[CLIENT_COUNT];
-Session sessions[SESSION_COUNT];
-std::mutex clients_sessions_mutex;
+Shard shards[SHARD_COUNT];
+thread_local Shard *current_shard = nullptr;
+
+enum PacketFlags : uint8_t {
+  ROUTE_BY_ADDRESS = 1 << 0, // sent before the client has an id
+  ROUTE_BY_SESSION = 1 << 1, // names only a session, handled by the session's shard
+  REQUIRES_SESSION = 1 << 2, // dropped unless the client it names is in a session
+  RELAY = 1 << 3, // forwarded to the other player of the session
+  CONTROL = 1 << 4, // may come wrapped in RELIABLE
+  FROM_MAIN = 1 << 5, // sent by the main of the session it names, whichever client it names
+  ANY_SENDER = 1 << 6 // accepted from unknown addresses, the handler checks packet.sender
+};
 
-std::queue<packet::Packet> packets;
+const uint8_t NO_FIELD = 0xff;
 
-enum PacketReadSteps {
-  READ_PREAMBLE = 0,
-  READ_TYPE = 1,
-  READ_SIZE = 2,
-  READ_DATA = 3,
-  READ_CRC  = 4
+// what the server does with one packet type, looked up by the type byte
+struct PacketHandler {
+  void (*handle)(packet::Packet &packet); // nullptr for types clients do not send
+  uint8_t flags;
+  uint8_t client_field; // data offset of the client id or NO_FIELD
+  uint8_t session_field; // data offset of the session id or NO_FIELD
+  limiter::Budget budget; // what the packet is counted against per source
 };
 
+// receive side of one socket, driven by its event loop
+struct Listener : event_loop::Handler {
+  int id;
+  int sockfd;
+  buffer::Pool pool;
+  limiter::SourceLimiter limiter;
+
+  void on_datagrams(event_loop::Datagram *datagrams, int count) override;
+  void on_timer() override;
+};
+
+Listener listeners[config::MAX_LISTENERS];
+
 void set_server_sock();
-void listen_for_packets();
-void process_packets();
-void process_logs();
-void log_message(std::string message);
-void send_packet(sockaddr_in *addr, packet::SendData *packet);
-void init_clients();
-void init_sessions();
+int open_listener_socket();
+void pin_thread(pthread_t thread, int cpu);
+void request_shutdown(int);
+void stop_workers();
+int create_stale_check_timer();
+uint64_t current_tick();
+void listen_for_packets(int listener);
+int open_metrics_socket(const char *path);
+void collect_metrics(std::string &out);
+void route_packet(int listener, packet::Packet &packet);
+void publish_packets(int listener);
+int packet_shard(packet::Packet &packet);
+int session_shard(uint16_t session_id);
+void forward_packet(int shard_id, packet::Packet &packet);
+void migrate_client(uint16_t client_id, int shard_id);
+int shard_with_free_sessions();
+void request_stale_check();
+void process_packets(Shard *shard);
+int handle_control_packets(Shard *shard);
+int handle_position_packets(Shard *shard);
+bool newest_update(uint32_t *seen, int *kept, packet::Packet *batch, int i, bool *newest);
+uint32_t update_seq(packet::Packet &packet);
+bool has_work(Shard *shard);
+void wait_for_work(Shard *shard);
+void process_handoff(Shard *shard);
+bool authenticate(packet::Packet &packet);
+bool sender_allowed(packet::Packet &packet);
+void drop_packet(DropReason reason, uint8_t type);
+void handle_packet(packet::Packet &packet);
+uint16_t packet_id(packet::Packet &packet, uint8_t field);
+void handle_connect(packet::Packet &packet);
+void handle_disconnect(packet::Packet &packet);
+void handle_create_session(packet::Packet &packet);
+void handle_assign_to_session(packet::Packet &packet);
+void handle_disconnect_from_session(packet::Packet &packet);
+void handle_set_ready(packet::Packet &packet);
+void handle_set_ball_pos(packet::Packet &packet);
+void handle_set_player_pos(packet::Packet &packet);
+void handle_point_scored(packet::Packet &packet);
+void handle_im_alive(packet::Packet &packet);
+void handle_snapshot_ack(packet::Packet &packet);
+void handle_reliable(packet::Packet &packet);
+void handle_ack(packet::Packet &packet);
+void send_packet(Endpoint *addr, packet::SendData &packet);
+template<packet::PacketType Type, typename... Args>
+void send_control_packet(uint16_t client_id, Args &&...args);
+void send_reliable_packet(uint16_t client_id, packet::SendData &packet);
+packet::SendData *queue_packet(Endpoint *addr);
+void flush_outbound();
+void init_pools();
+void init_shards();
+bool grow_clients(Shard *shard);
+bool grow_sessions(Shard *shard);
 int find_available_client_id(bool include_scheduled_to_disconnect);
 int find_available_session_id();
-void use_client(uint16_t id, sockaddr_in addr);
+void use_client(uint16_t id, Endpoint addr);
 void use_session(uint16_t id, uint16_t main_id);
 void disconnect_stale_clients();
+void set_game_active(Session *session, bool active);
+void mark_session_dirty(Session *session, uint8_t changes);
+void broadcast_positions();
+void send_compact_snapshot(Endpoint *addr, Session *session, uint32_t acked);
+void acknowledge_snapshot(uint16_t client_id, uint32_t seq);
 void disconnect_client(uint16_t id, bool inform);
 void destroy_session(uint16_t id);
-void connect_client(sockaddr_in addr);
+void connect_client(Endpoint addr, bool negotiate, packet::Capability capabilities);
 void create_session(uint16_t main_id);
 void disconnect_from_session(uint16_t session_id, uint16_t client_id);
 void assign_to_session(uint16_t session_id, uint16_t client_id);
 void set_client_ready(uint16_t client_id, uint16_t session_id, packet::Readiness readiness);
-void set_ball_pos(uint16_t session_id, types::Vector2 &ball_pos, types::Vector2 &ball_dir);
-void set_player_pos(uint16_t client_id, types::Vector2 &player_pos, types::Vector2 &player_dir);
-void handle_client_alive(sockaddr_in addr, uint16_t client_id);
+void set_ball_pos(uint16_t session_id, types::Vector2 &ball_pos, types::Vector2 &ball_dir, uint32_t seq);
+void set_player_pos(uint16_t client_id, types::Vector2 &player_pos, types::Vector2 &player_dir, uint32_t seq);
+bool is_stale(uint32_t seq, uint32_t &last);
+void handle_client_alive(Endpoint addr, uint16_t client_id, uint16_t sender);
 void score_point(uint16_t session_id, uint16_t client_id);
 void set_client_msg_time(uint16_t client_id);
+int64_t steady_now_ns();
+void track_retransmits(uint16_t client_id);
+void untrack_retransmits(uint16_t client_id);
+void retransmit_control_packets();
+void resend_control_packet(uint16_t client_id, reliable::Pending &entry);
 
 // send packet functions
-void send_connected_packet(sockaddr_in *addr, uint16_t client_id);
-void send_could_not_connect_packet(sockaddr_in *addr);
-void send_disconnected_packet(sockaddr_in *addr);
-void send_assigned_to_session_packet(sockaddr_in *addr, uint16_t session_id, uint16_t client_id, packet::ClientType type);
-void send_could_not_create_session(sockaddr_in *addr);
-void send_session_disconnect_status_packet(sockaddr_in *addr, uint16_t session_id, uint16_t client_id, packet::SessionDisconnectStatus status);
-void send_could_not_assign_to_session_packet(sockaddr_in *addr, uint16_t session_id);
-void send_inform_client_ready_packet(sockaddr_in *addr, uint16_t session_id, uint16_t client_id, packet::Readiness readiness);
-void send_game_started_packet(sockaddr_in *addr, uint16_t session_id);
-void send_ball_pos_packet(sockaddr_in *addr, Session *session);
-void send_point_scored_packet(sockaddr_in *addr, Session *session, uint16_t client_id);
-void send_player_pos_packet(sockaddr_in *addr, Client *client);
-void send_player_won_packet(Session *session, Client *client);
-
-int main() {
-  sem_init(&free_space, 0, MAX_PACKET_COUNT);
-  sem_init(&full_space, 0, 0);
-  sem_init(&logs_available, 0, 0);
-
-  init_clients();
-  init_sessions();
-
-  if((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-    perror("socket creation failed");
+void send_connected_packet(Endpoint *addr, uint16_t client_id, bool negotiate);
+void send_could_not_connect_packet(Endpoint *addr);
+void send_disconnected_packet(Endpoint *addr);
+void send_assigned_to_session_packet(uint16_t to, uint16_t session_id, uint16_t client_id, packet::ClientType type);
+void send_could_not_create_session(uint16_t to);
+void send_session_disconnect_status_packet(uint16_t to, uint16_t session_id, uint16_t client_id, packet::SessionDisconnectStatus status);
+void send_could_not_assign_to_session_packet(uint16_t to, uint16_t session_id);
+void send_inform_client_ready_packet(uint16_t to, uint16_t session_id, uint16_t client_id, packet::Readiness readiness);
+void send_game_started_packet(uint16_t to, uint16_t session_id);
+void send_point_scored_packet(uint16_t to, Session *session, uint16_t client_id);
+void send_player_pos_packet(Endpoint *addr, uint16_t client_id);
+void send_ball_pos_packet(Endpoint *addr, Session *session);
+void send_player_won_packet(Session *session, uint16_t client_id);
+
+// client and session fields are given by their index in the type's schema, -1 for none
+template<packet::PacketType Type>
+constexpr PacketHandler packet_handler(void (*handle)(packet::Packet&), uint8_t flags, limiter::Budget budget, int client_index, int session_index) {
+  using Schema = packet::Schema<Type>;
+  return PacketHandler{
+    handle,
+    flags,
+    client_index < 0 ? NO_FIELD : (uint8_t)Schema::OFFSETS[client_index],
+    session_index < 0 ? NO_FIELD : (uint8_t)Schema::OFFSETS[session_index],
+    budget
+  };
+}
+
+constexpr std::array<PacketHandler, 256> packet_handlers = [] {
+  using namespace packet;
+  std::array<PacketHandler, 256> handlers;
+  handlers.fill(PacketHandler{nullptr, 0, NO_FIELD, NO_FIELD, limiter::CONTROL});
+  handlers[CONNECT] = packet_handler<CONNECT>(handle_connect, ROUTE_BY_ADDRESS, limiter::CONNECT, -1, -1);
+  handlers[DISCONNECT] = packet_handler<DISCONNECT>(handle_disconnect, CONTROL, limiter::CONTROL, 0, -1);
+  handlers[CREATE_SESSION] = packet_handler<CREATE_SESSION>(handle_create_session, CONTROL, limiter::CONTROL, 0, -1);
+  handlers[ASSIGN_TO_SESSION] = packet_handler<ASSIGN_TO_SESSION>(handle_assign_to_session, CONTROL, limiter::CONTROL, 0, 1);
+  handlers[DISCONNECT_FROM_SESSION] = packet_handler<DISCONNECT_FROM_SESSION>(handle_disconnect_from_session, CONTROL, limiter::CONTROL, 1, 0);
+  handlers[SET_READY] = packet_handler<SET_READY>(handle_set_ready, REQUIRES_SESSION | CONTROL, limiter::CONTROL, 0, 1);
+  handlers[SET_BALL_POS] = packet_handler<SET_BALL_POS>(handle_set_ball_pos, ROUTE_BY_SESSION | RELAY | FROM_MAIN, limiter::POSITION, -1, 0);
+  handlers[SET_PLAYER_POS] = packet_handler<SET_PLAYER_POS>(handle_set_player_pos, REQUIRES_SESSION | RELAY, limiter::POSITION, 0, -1);
+  handlers[POINT_SCORED] = packet_handler<POINT_SCORED>(handle_point_scored, REQUIRES_SESSION | CONTROL | FROM_MAIN, limiter::CONTROL, 1, 0);
+  handlers[IM_ALIVE] = packet_handler<IM_ALIVE>(handle_im_alive, ANY_SENDER, limiter::CONTROL, 0, -1);
+  handlers[SNAPSHOT_ACK] = packet_handler<SNAPSHOT_ACK>(handle_snapshot_ack, REQUIRES_SESSION, limiter::POSITION, 0, -1);
+  handlers[RELIABLE] = packet_handler<RELIABLE>(handle_reliable, 0, limiter::CONTROL, 0, -1);
+  handlers[ACK] = packet_handler<ACK>(handle_ack, 0, limiter::CONTROL, 0, -1);
+  return handlers;
+}();
+
+int main(int argc, char **argv) {
+  if(!config::load(argc, argv, settings)) {
+    fprintf(stderr, "see %s --help\n", argv[0]);
     return 1;
   }
+  if(!crc::self_check()) {
+    fprintf(stderr, "crc self check failed\n");
+    return 1;
+  }
+  init_pools();
+  init_shards();
 
   set_server_sock();
 
-  if(bind(sockfd, (const struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
-    perror("bind failed");
-    return 1;
+  for(int i = 0; i < settings.listeners; i++) {
+    if((sockfds[i] = open_listener_socket()) < 0) return 1;
   }
 
-  std::thread listen_thread(listen_for_packets);
-  std::thread process_thread(process_packets);
-  std::thread logs_thread(process_logs);
+  shutdown_fd = eventfd(0, EFD_CLOEXEC);
+  if((stale_check_fd = create_stale_check_timer()) < 0) return 1;
+  if(!settings.metrics_socket.empty() && (metrics_fd = open_metrics_socket(settings.metrics_socket.c_str())) < 0) return 1;
+  signal(SIGINT, request_shutdown);
+  signal(SIGTERM, request_shutdown);
 
-  // this loop has to work rarely and iteration should be very quick
-  while(server_running) {
-    {
-      lock_guard lock(clients_sessions_mutex);
-      disconnect_stale_clients();
-    }
-    usleep(MAIN_LOOP_DELAY_US);
+  std::thread process_threads[SHARD_COUNT];
+  for(int i = 0; i < SHARD_COUNT; i++) {
+    process_threads[i] = std::thread(process_packets, &shards[i]);
+  }
+  std::thread logs_thread(logger::run);
+  std::thread metrics_thread;
+  if(metrics_fd >= 0) metrics_thread = std::thread(metrics::serve, metrics_fd, shutdown_fd, collect_metrics);
+
+  // the main thread runs the first listener itself, the rest get their own threads
+  std::thread listen_threads[config::MAX_LISTENERS];
+  for(int i = 1; i < settings.listeners; i++) {
+    listen_threads[i] = std::thread(listen_for_packets, i);
+    if(settings.pin_listeners) pin_thread(listen_threads[i].native_handle(), i);
   }
+  if(settings.pin_listeners) pin_thread(pthread_self(), 0);
+  listen_for_packets(0);
 
-  listen_thread.join();
-  process_thread.join();
+  for(int i = 1; i < settings.listeners; i++) {
+    listen_threads[i].join();
+  }
+  stop_workers();
+  for(int i = 0; i < SHARD_COUNT; i++) {
+    process_threads[i].join();
+  }
+  if(metrics_thread.joinable()) metrics_thread.join();
+  logger::log(logger::STALE_UPDATES_DROPPED, metrics::total(metrics::STALE_PLAYER_UPDATES), metrics::total(metrics::STALE_BALL_UPDATES));
+  logger::log(logger::UPDATES_COALESCED, metrics::total(metrics::COALESCED_UPDATES));
+  logger::log(logger::PACKETS_DROPPED, metrics::total(metrics::DROPPED_INVALID), metrics::total(metrics::DROPPED_UNAUTHENTICATED), metrics::total(metrics::DROPPED_RATE_LIMITED), metrics::total(metrics::DROPPED_SHED));
+  logger::stop();
   logs_thread.join();
 
-  sem_destroy(&free_space);
-  sem_destroy(&full_space);
-  sem_destroy(&logs_available);
+  for(int i = 0; i < settings.listeners; i++) {
+    close(sockfds[i]);
+  }
+  close(stale_check_fd);
+  close(shutdown_fd);
+  if(metrics_fd >= 0) {
+    close(metrics_fd);
+    unlink(settings.metrics_socket.c_str());
+  }
   return 0;
 }
 
+// only async-signal-safe calls in here
+void request_shutdown(int) {
+  server_running = false;
+  uint64_t one = 1;
+  if(write(shutdown_fd, &one, sizeof(one)) < 0) return;
+}
+
+void stop_workers() {
+  server_running = false;
+  for(int i = 0; i < SHARD_COUNT; i++) {
+    shards[i].work_available.notify();
+  }
+}
+
+int create_stale_check_timer() {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if(fd < 0) {
+    perror("timerfd creation failed");
+    return -1;
+  }
+  itimerspec interval;
+  interval.it_interval.tv_sec = STALE_CHECK_INTERVAL_MS / 1000;
+  interval.it_interval.tv_nsec = (long)(STALE_CHECK_INTERVAL_MS % 1000) * 1'000'000;
+  interval.it_value = interval.it_interval;
+  timerfd_settime(fd, 0, &interval, nullptr);
+  return fd;
+}
+
+// stale check ticks on the monotonic clock, wall clock jumps do not make clients stale
+uint64_t current_tick() {
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(now).count() / STALE_CHECK_INTERVAL_MS;
+}
+
 void set_server_sock() {
   servaddr.sin_family = AF_INET;
   servaddr.sin_addr.s_addr = INADDR_ANY;
-  servaddr.sin_port = htons(PORT);
+  servaddr.sin_port = htons(settings.port);
+}
+
+int open_listener_socket() {
+  int fd;
+  if((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+    perror("socket creation failed");
+    return -1;
+  }
+
+  if(settings.listeners > 1) {
+    // the kernel spreads clients over the sockets by hashing their address
+    int enable = 1;
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+      perror("setting SO_REUSEPORT failed");
+      return -1;
+    }
+  }
+
+  if(bind(fd, (const struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+    perror("bind failed");
+    return -1;
+  }
+  return fd;
 }
 
-void listen_for_packets() {
-  sockaddr_in clientaddr;
-  socklen_t len = sizeof(clientaddr);
-  int n;
-  uint8_t buffer[packet::MAX_PACKET_SIZE];
+// a stream socket that gets one metrics snapshot written to every connection, e.g. read
+// with socat - UNIX-CONNECT:path. A file left behind by an earlier run is replaced.
+int open_metrics_socket(const char *path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "metrics socket path too long\n");
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd;
+  if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    perror("metrics socket creation failed");
+    return -1;
+  }
+  unlink(path);
+  if(bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+    perror("metrics socket bind failed");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
 
-  PacketReadSteps current_step = READ_PREAMBLE;
+// the registry plus what is sampled on every read: ring depths and dropped log records
+void collect_metrics(std::string &out) {
+  metrics::render(out);
+
+  // every metric's samples have to stay together
+  metrics::render_header(out, "pong_queue_depth", "gauge", "Packets waiting for a shard, by lane.");
+  for(int i = 0; i < SHARD_COUNT; i++) {
+    std::string shard = "shard=\"" + std::to_string(i) + "\",";
+    for(int listener = 0; listener < settings.listeners; listener++) {
+      std::string labels = shard + "listener=\"" + std::to_string(listener) + "\",lane=";
+      metrics::render_sample(out, "pong_queue_depth", labels + "\"control\"", shards[i].control[listener].size());
+      metrics::render_sample(out, "pong_queue_depth", labels + "\"positions\"", shards[i].positions[listener].size());
+    }
+    metrics::render_sample(out, "pong_queue_depth", shard + "lane=\"handoff\"", shards[i].handoff_pending.load(std::memory_order_relaxed));
+  }
+  metrics::render_header(out, "pong_queue_capacity", "gauge", "Packets a lane can hold.");
+  for(int i = 0; i < SHARD_COUNT; i++) {
+    for(int listener = 0; listener < settings.listeners; listener++) {
+      std::string labels = "shard=\"" + std::to_string(i) + "\",listener=\"" + std::to_string(listener) + "\",lane=";
+      metrics::render_sample(out, "pong_queue_capacity", labels + "\"control\"", shards[i].control[listener].capacity());
+      metrics::render_sample(out, "pong_queue_capacity", labels + "\"positions\"", shards[i].positions[listener].capacity());
+    }
+  }
+
+  metrics::render_header(out, "pong_log_records_dropped_total", "counter", "Log records dropped because a thread's log ring was full.");
+  metrics::render_sample(out, "pong_log_records_dropped_total", "", logger::dropped());
+}
+
+void pin_thread(pthread_t thread, int cpu) {
+  unsigned int cpu_count = std::max(1u, std::thread::hardware_concurrency());
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu % cpu_count, &cpus);
+  pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpus);
+}
+
+void listen_for_packets(int listener) {
+  Listener *handler = &listeners[listener];
+  handler->id = listener;
+  handler->sockfd = sockfds[listener];
+  handler->pool.init(RECV_BUFFER_COUNT, packet::MAX_PACKET_SIZE + event_loop::RECV_HEADROOM);
+  int rates[limiter::BUDGET_COUNT];
+  rates[limiter::POSITION] = settings.position_rate;
+  rates[limiter::CONTROL] = settings.control_rate;
+  rates[limiter::CONNECT] = settings.connect_rate;
+  handler->limiter.init(RATE_LIMITED_SOURCES, rates);
+
+  event_loop::Config config;
+  config.sockfd = sockfds[listener];
+  config.timer_fd = listener == 0 ? stale_check_fd : -1;
+  config.shutdown_fd = shutdown_fd;
+  config.batch_size = RECV_BATCH_SIZE;
+  config.pool = &handler->pool;
+
+  auto loop = event_loop::create(settings.backend, config);
+  if(listener == 0) logger::log(logger::LISTENING, settings.port, loop->name(), crc::implementation_name());
+  loop->run(*handler);
+}
+
+void Listener::on_datagrams(event_loop::Datagram *datagrams, int received) {
+  metrics::count(metrics::RECV_BATCHES);
+  metrics::count(metrics::DATAGRAMS_RECEIVED, received);
+
+  // one clock read per batch is precise enough for the rate limits and latencies
+  int64_t now_ns = steady_now_ns();
+  int crc_failures = 0;
   packet::Packet packet;
-  
-  uint8_t bytes[packet::MAX_PACKET_SIZE];
-  uint16_t byte_pos;
+  packet.sockfd = sockfd;
+  packet.received_ns = now_ns;
+  for(int m = 0; m < received; m++) {
+    packet.clientaddr = *datagrams[m].addr;
+    packet.buffer = datagrams[m].buffer;
+
+    // one datagram may carry several packets, all of them point into the same buffer
+    int pos = 0;
+    while(packet::parse_packet(datagrams[m].data, datagrams[m].size, pos, packet, crc_failures)) {
+      metrics::count_type(metrics::PACKETS_RECEIVED, packet.type);
+      if(!packet::verify_packet(packet) || packet_handlers[packet.type].handle == nullptr) {
+        drop_packet(DROP_INVALID, packet.type);
+        continue;
+      }
+      if(!authenticate(packet)) {
+        drop_packet(DROP_UNAUTHENTICATED, packet.type);
+        continue;
+      }
+      // checked before the packet takes a ring slot, so one source cannot fill the rings
+      if(!limiter.allow(packet.clientaddr.sin_addr.s_addr, packet.clientaddr.sin_port, packet_handlers[packet.type].budget, now_ns)) {
+        drop_packet(DROP_RATE_LIMITED, packet.type);
+        continue;
+      }
+      route_packet(id, packet);
+    }
+  }
+  if(crc_failures > 0) metrics::count(metrics::CRC_FAILURES, crc_failures);
+
+  // everything parsed from this batch becomes visible to the shards at once
+  publish_packets(id);
+}
 
-  memcpy(bytes, packet::PREAMBLE, packet::PREAMBLE_SIZE);
-  byte_pos = packet::PREAMBLE_SIZE;
+void Listener::on_timer() {
+  request_stale_check();
+}
+
+// position updates are shed once the shard's position ring is mostly full, the next
+// update replaces them anyway. Control packets wait for room.
+void route_packet(int listener, packet::Packet &packet) {
+  Shard *shard = &shards[packet_shard(packet)];
+  bool position = packet_handlers[packet.type].budget == limiter::POSITION;
+  auto &packets = position ? shard->positions[listener] : shard->control[listener];
+  if(position && packets.more_than(packets.capacity() * SHED_FILL_PERCENT / 100)) {
+    drop_packet(DROP_SHED, packet.type);
+    return;
+  }
+  packet::Packet *slot;
+  while((slot = packets.reserve()) == nullptr) {
+    // shard fell behind, hand over what we have and wait for it to catch up
+    publish_packets(listener);
+    std::this_thread::yield();
+  }
+  buffer::retain(packet.buffer);
+  *slot = packet;
+  packets.commit();
+}
+
+void publish_packets(int listener) {
+  for(int i = 0; i < SHARD_COUNT; i++) {
+    bool published = shards[i].control[listener].publish();
+    published = shards[i].positions[listener].publish() || published;
+    if(published) shards[i].work_available.notify();
+  }
+}
+
+// CONNECT has no client yet, so it is spread by source address. SET_BALL_POS only names
+// the session. Everything else goes to the shard owning the client it names.
+int packet_shard(packet::Packet &packet) {
+  const PacketHandler &handler = packet_handlers[packet.type];
+  if(handler.flags & ROUTE_BY_ADDRESS) {
+    uint32_t hash = packet.clientaddr.sin_addr.s_addr ^ (packet.clientaddr.sin_port * 2654435761u);
+    return hash % SHARD_COUNT;
+  }
+  if(handler.flags & ROUTE_BY_SESSION) {
+    return session_shard(packet_id(packet, handler.session_field));
+  }
+  if(handler.client_field == NO_FIELD) return 0;
+
+  uint16_t client_id = packet_id(packet, handler.client_field);
+  if(client_id >= clients.size()) return 0;
+  return client_owner[client_id].load(std::memory_order_acquire);
+}
+
+// unallocated ids go to shard 0, which drops them
+int session_shard(uint16_t session_id) {
+  if(session_id >= sessions.size()) return 0;
+  return session_owner[session_id].load(std::memory_order_acquire);
+}
+
+void forward_packet(int shard_id, packet::Packet &packet) {
+  Shard *shard = &shards[shard_id];
+  {
+    lock_guard lock(shard->handoff_mutex);
+    buffer::retain(packet.buffer);
+    shard->handoff.push(packet);
+  }
+  shard->handoff_pending.fetch_add(1, std::memory_order_release);
+  shard->work_available.notify();
+}
+
+// the client's state belongs to the new shard from now on. Packets that still reach
+// the old shard are forwarded by handle_packet.
+void migrate_client(uint16_t client_id, int shard_id) {
+  // it just sent a packet, so it is not stale, and this shard's lists must not keep it
+  Client *client = &clients[client_id];
+  if(client->scheduled_to_disconnect) {
+    current_shard->stale_clients.remove(client);
+    client->scheduled_to_disconnect = false;
+  }
+  // the new shard puts it into its own wheel when it handles the forwarded packet
+  current_shard->client_expiry.remove(client);
+  // and so does tracking its unacked control packets, from its next reliable send
+  untrack_retransmits(client_id);
+  client_owner[client_id].store(shard_id, std::memory_order_release);
+}
+
+int shard_with_free_sessions() {
+  for(int i = 1; i < SHARD_COUNT; i++) {
+    int shard_id = (current_shard->id + i) % SHARD_COUNT;
+    if(!shards[shard_id].out_of_sessions.load(std::memory_order_relaxed)) return shard_id;
+  }
+  return -1;
+}
+
+void request_stale_check() {
+  for(int i = 0; i < SHARD_COUNT; i++) {
+    shards[i].stale_check_requested.store(true, std::memory_order_release);
+    shards[i].work_available.notify();
+  }
+}
+
+void process_packets(Shard *shard) {
+  current_shard = shard;
 
   while(server_running) {
-    n = recvfrom(sockfd, buffer, packet::MAX_PACKET_SIZE, MSG_WAITALL, (struct sockaddr *) &clientaddr, &len);
-
-    // std::ostringstream oss;
-    // oss << "DATA ";
-    // for(int i = 0; i < n; i++) {
-    //   oss << std::hex << +(uint8_t)buffer[i] << " ";
-    // }
-    // log_message(oss.str());
-
-#ifdef CALC_PROCESSED
-    int packets_processed = 0;
-#endif  
-  
-    for(int i = 0; i < n;) {
-      unsigned long bytes_available = n - i;
-
-      switch(current_step) {
-        case READ_PREAMBLE: {
-          if(n >= packet::PREAMBLE_SIZE && std::memcmp(buffer, packet::PREAMBLE, packet::PREAMBLE_SIZE) == 0) {
-            current_step = READ_TYPE;
-            i += packet::PREAMBLE_SIZE;
-            packet.clientaddr = clientaddr;
-          } else {
-            i++;
-          }
-        } break;
-        case READ_TYPE: {
-          packet.type = buffer[i];
-          bytes[byte_pos] = buffer[i];
-          current_step = READ_SIZE;
-          byte_pos++;
-          i++;
-        } break;
-        case READ_SIZE: {
-          bytes_available = std::min(bytes_available, sizeof(uint16_t));
-          memcpy(&packet.size, &buffer[i], bytes_available);
-          memcpy(&bytes[byte_pos], &buffer[i], bytes_available);
-          current_step = READ_DATA;
-          byte_pos += bytes_available;
-          i += bytes_available;
-        } break;
-        case READ_DATA: {
-          bytes_available = std::min(bytes_available, (unsigned long)packet.size);
-          memcpy(packet.data, &buffer[i], bytes_available);
-          memcpy(&bytes[byte_pos], &buffer[i], bytes_available);
-          current_step = READ_CRC;
-          byte_pos += bytes_available;
-          i += bytes_available;
-        } break;
-        case READ_CRC: {
-          bytes_available = std::min(bytes_available, sizeof(uint16_t));
-          memcpy(&packet.crc, &buffer[i], bytes_available);
-          i += bytes_available;
-          
-          uint16_t calc_crc = packet::crc16(bytes, byte_pos);
-
-          if(calc_crc == packet.crc) { // crc correct
-            sem_wait(&free_space);
-            {
-              lock_guard lock(packet_mutex);
-              packets.push(packet);
-            }
-            sem_post(&full_space);
-          }
-          // do nothing when packet crc is incorrect
-
-          byte_pos = packet::PREAMBLE_SIZE;
-          current_step = READ_PREAMBLE;
-#ifdef CALC_PROCESSED
-          packets_processed++;
-#endif
-        } break;
+    if(shard->stale_check_requested.exchange(false, std::memory_order_acq_rel)) {
+      disconnect_stale_clients();
+    }
+    if(shard->handoff_pending.load(std::memory_order_acquire) > 0) {
+      process_handoff(shard);
+    }
+    // without a tick rate the deadline never holds anything back, so the updates handled
+    // in one pass are relayed at the start of the next, once per session however many came
+    if(!shard->dirty_sessions.empty()) {
+      auto now = std::chrono::steady_clock::now();
+      if(now >= shard->next_broadcast) {
+        broadcast_positions();
+        // an idle shard does not make up for the ticks it slept through
+        shard->next_broadcast += broadcast_interval;
+        if(shard->next_broadcast <= now) shard->next_broadcast = now + broadcast_interval;
       }
     }
-#ifdef CALC_PROCESSED
-    log_message("Processed " + std::to_string(packets_processed) + " packets.");
-#endif
+    if(!shard->retransmit_clients.empty()) {
+      auto now = std::chrono::steady_clock::now();
+      if(now >= shard->next_retransmit_check) {
+        retransmit_control_packets();
+        shard->next_retransmit_check = now + std::chrono::milliseconds(RETRANSMIT_CHECK_INTERVAL_MS);
+      }
+    }
+
+    // positions only get a turn once no control packet is waiting, so lobby and scoring
+    // packets never queue up behind a burst of position updates
+    int handled = handle_control_packets(shard);
+    if(handled == 0) handled = handle_position_packets(shard);
+    if(handled == 0) wait_for_work(shard);
   }
+  flush_outbound();
 }
 
-void process_packets() {
-  while(server_running) {
-    packet::Packet packet;
-    sem_wait(&full_space);
-    {
-      lock_guard lock(packet_mutex);
-      packet = packets.front();
+// takes a batch from every listener's ring in turn so none of them is starved
+int handle_control_packets(Shard *shard) {
+  int handled = 0;
+  int64_t now_ns = steady_now_ns();
+  for(int listener = 0; listener < settings.listeners; listener++) {
+    auto &packets = shard->control[listener];
+    packet::Packet *packet;
+    for(int i = 0; i < RECV_BATCH_SIZE && (packet = packets.front()) != nullptr; i++) {
+      metrics::observe(metrics::PROCESSING_LATENCY, now_ns - packet->received_ns);
+      handle_packet(*packet);
+      buffer::release(packet->buffer);
       packets.pop();
+      handled++;
     }
-    sem_post(&free_space);
-
-    if(packet::verify_packet(packet)) {
-      lock_guard data_lock(clients_sessions_mutex);
-      switch(packet.type) {
-        case packet::PacketType::CONNECT: {
-          connect_client(packet.clientaddr);
-        } break;
-        case packet::PacketType::DISCONNECT: {
-          uint16_t client_id = packet::get_id_from_packet(packet, 0);
-          disconnect_client(client_id, false);
-        } break;
-        case packet::PacketType::CREATE_SESSION: {
-          uint16_t main_id = packet::get_id_from_packet(packet, 0);
-          create_session(main_id);
-        } break;
-        case packet::PacketType::ASSIGN_TO_SESSION: {
-          uint16_t client_id = packet::get_id_from_packet(packet, 0);
-          uint16_t session_id = packet::get_id_from_packet(packet, 2);
-          assign_to_session(session_id, client_id);
-        } break;
-        case packet::PacketType::DISCONNECT_FROM_SESSION: {
-          uint16_t session_id = packet::get_id_from_packet(packet, 0);
-          uint16_t client_id = packet::get_id_from_packet(packet, 2);
-          disconnect_from_session(session_id, client_id);
-        } break;
-        case packet::PacketType::SET_READY: {
-          uint16_t client_id = packet::get_id_from_packet(packet, 0);
-          uint16_t session_id = packet::get_id_from_packet(packet, 2);
-          packet::Readiness readiness = static_cast<packet::Readiness>(packet.data[4]);
-          set_client_ready(client_id, session_id, readiness);
-        } break;
-        case packet::PacketType::SET_BALL_POS: {
-          uint16_t session_id = packet::get_id_from_packet(packet, 0);
-          types::Vector2 ball_pos, ball_dir;
-          ball_pos = types::decode_vec2(&packet.data[2]);
-          ball_dir = types::decode_vec2(&packet.data[2+12]);
-          set_ball_pos(session_id, ball_pos, ball_dir);
-        } break;
-        case packet::PacketType::SET_PLAYER_POS: {
-          uint16_t client_id = packet::get_id_from_packet(packet, 0);
-
-          types::Vector2 player_pos, player_dir;
-          player_pos = types::decode_vec2(&packet.data[2]);
-          player_dir = types::decode_vec2(&packet.data[2+12]);
-          set_player_pos(client_id, player_pos, player_dir);
-        } break;
-        case packet::PacketType::POINT_SCORED: {
-          uint16_t session_id = packet::get_id_from_packet(packet, 0);
-          uint16_t client_id = packet::get_id_from_packet(packet, 2);
-          score_point(session_id, client_id);
-        } break;
-        case packet::PacketType::IM_ALIVE: {
-          uint16_t client_id = packet::get_id_from_packet(packet, 0);
-          handle_client_alive(packet.clientaddr, client_id);
-        } break;
-      }
+  }
+  return handled;
+}
+
+// like handle_control_packets, but of the updates one sender has in a batch only the
+// newest is handled, the older ones would be overwritten right away
+int handle_position_packets(Shard *shard) {
+  int handled = 0;
+  uint64_t coalesced = 0;
+  int64_t now_ns = steady_now_ns();
+  for(int listener = 0; listener < settings.listeners; listener++) {
+    auto &packets = shard->positions[listener];
+    packet::Packet batch[RECV_BATCH_SIZE];
+    int count = 0;
+    packet::Packet *packet;
+    while(count < RECV_BATCH_SIZE && (packet = packets.front()) != nullptr) {
+      batch[count++] = *packet;
+      packets.pop();
     }
+
+    uint32_t seen[COALESCE_SLOTS] = {};
+    int kept[COALESCE_SLOTS];
+    bool newest[RECV_BATCH_SIZE];
+    for(int i = 0; i < count; i++) {
+      newest[i] = newest_update(seen, kept, batch, i, newest);
+    }
+    for(int i = 0; i < count; i++) {
+      metrics::observe(metrics::PROCESSING_LATENCY, now_ns - batch[i].received_ns);
+      if(newest[i]) handle_packet(batch[i]);
+      else coalesced++;
+      buffer::release(batch[i].buffer);
+    }
+    handled += count;
   }
+  if(coalesced > 0) metrics::count(metrics::COALESCED_UPDATES, coalesced);
+  return handled;
 }
 
-void send_packet(sockaddr_in *addr, packet::SendData &packet) {
-  lock_guard lock(send_mutex);
-  sendto(sockfd, packet.data, packet.size, MSG_CONFIRM, (const struct sockaddr*)addr, sizeof(sockaddr_in));
+// whether batch[i] is the newest update of its type from its sender so far. seen holds
+// the senders met in the batch and kept the index of the update picked for each, which
+// batch[i] replaces (clearing its newest entry) when it is newer. Keyed by the
+// authenticated sender, not the ids in the data, so nobody can make the server skip
+// another client's updates. Only relayed positions are coalesced, snapshot acks are all
+// handled.
+bool newest_update(uint32_t *seen, int *kept, packet::Packet *batch, int i, bool *newest) {
+  packet::Packet &packet = batch[i];
+  if(!(packet_handlers[packet.type].flags & RELAY)) return true;
+  uint32_t key = ((uint32_t)packet.type << 16 | packet.sender) + 1;
+  for(uint32_t slot = (key * 2654435761u) % COALESCE_SLOTS;; slot = (slot + 1) % COALESCE_SLOTS) {
+    if(seen[slot] == 0) {
+      seen[slot] = key;
+      kept[slot] = i;
+      return true;
+    }
+    if(seen[slot] != key) continue;
+    // sequenced updates may arrive out of order, the highest seq wins like in is_stale.
+    // Without a seq on both the later arrival wins.
+    uint32_t seq = update_seq(packet), kept_seq = update_seq(batch[kept[slot]]);
+    if(seq != 0 && kept_seq != 0 && (int32_t)(seq - kept_seq) <= 0) return false;
+    newest[kept[slot]] = false;
+    kept[slot] = i;
+    return true;
+  }
 }
 
-void init_clients() {
-  for(int i = 0; i < CLIENT_COUNT; i++) {
-    clients[i].available = true;
-    clients[i].id = i;
+// the seq of an extended position update, 0 for an unsequenced one
+uint32_t update_seq(packet::Packet &packet) {
+  if(!packet::is_extended(packet)) return 0;
+  if(packet.type == packet::SET_BALL_POS) return packet::Schema<packet::SET_BALL_POS>::Extended::get<3>(packet.data);
+  return packet::Schema<packet::SET_PLAYER_POS>::Extended::get<3>(packet.data);
+}
+
+bool has_work(Shard *shard) {
+  for(int listener = 0; listener < settings.listeners; listener++) {
+    if(shard->control[listener].front() != nullptr || shard->positions[listener].front() != nullptr) return true;
   }
+  return shard->handoff_pending.load(std::memory_order_acquire) > 0
+    || shard->stale_check_requested.load(std::memory_order_acquire)
+    || !server_running;
 }
 
-void init_sessions() {
-  for(int i = 0; i < SESSION_COUNT; i++) {
-    sessions[i].available = true;
-    sessions[i].id = i;
+void wait_for_work(Shard *shard) {
+  // nothing left to process, so this is the moment to send everything queued so far
+  flush_outbound();
+
+  for(int i = 0; i < ring::SPIN_COUNT; i++) {
+    if(has_work(shard)) return;
+    ring::cpu_relax();
+  }
+
+  // with positions or unacked control packets waiting, wake up in time to send them
+  int timeout_ms = -1;
+  if(!shard->dirty_sessions.empty()) {
+    auto left = shard->next_broadcast - std::chrono::steady_clock::now();
+    timeout_ms = std::max<int64_t>(0, std::chrono::ceil<std::chrono::milliseconds>(left).count());
+  }
+  if(!shard->retransmit_clients.empty()) {
+    auto left = shard->next_retransmit_check - std::chrono::steady_clock::now();
+    int retransmit_ms = std::max<int64_t>(0, std::chrono::ceil<std::chrono::milliseconds>(left).count());
+    timeout_ms = timeout_ms < 0 ? retransmit_ms : std::min(timeout_ms, retransmit_ms);
   }
+
+  uint32_t key = shard->work_available.prepare_wait();
+  if(has_work(shard)) {
+    shard->work_available.cancel_wait();
+    return;
+  }
+  shard->work_available.wait(key, timeout_ms);
 }
 
-int find_available_client_id(bool include_scheduled_to_disconnect) {
-  for(int id = 0; id < CLIENT_COUNT; id++) {
-    if(clients[id].available || (include_scheduled_to_disconnect && clients[id].scheduled_to_disconnect)) return id;
+void process_handoff(Shard *shard) {
+  std::queue<packet::Packet> handoff;
+  {
+    lock_guard lock(shard->handoff_mutex);
+    std::swap(handoff, shard->handoff);
+  }
+  shard->handoff_pending.fetch_sub(handoff.size(), std::memory_order_relaxed);
+
+  while(!handoff.empty()) {
+    handle_packet(handoff.front());
+    buffer::release(handoff.front().buffer);
+    handoff.pop();
   }
-  return -1;
 }
 
-int find_available_session_id() {
-  for(int id = 0; id < SESSION_COUNT; id++) {
-    if(sessions[id].available) return id;
+// Finds the sender by source address, so a client id in the data is never taken on trust.
+// A packet naming a client has to come from that client's address, except the ones the
+// main sends about its session, which handle_packet checks once it owns the session.
+bool authenticate(packet::Packet &packet) {
+  packet.sender = client_index.find(packet.clientaddr.sin_addr.s_addr, packet.clientaddr.sin_port);
+  return sender_allowed(packet);
+}
+
+// the checks of authenticate for a packet whose sender is already known
+bool sender_allowed(packet::Packet &packet) {
+  const PacketHandler &handler = packet_handlers[packet.type];
+  if(handler.flags & (ROUTE_BY_ADDRESS | ANY_SENDER)) return true;
+  if(packet.sender == address_index::NOT_FOUND) return false;
+  if(handler.flags & FROM_MAIN) return true;
+  return packet_id(packet, handler.client_field) == packet.sender;
+}
+
+void drop_packet(DropReason reason, uint8_t type) {
+  metrics::count_type((metrics::Family)reason, type);
+}
+
+// packets are verified and authenticated by the listener before they get here
+void handle_packet(packet::Packet &packet) {
+  const PacketHandler &handler = packet_handlers[packet.type];
+
+  // ids come from the network, never index with one that is out of range
+  if(handler.client_field != NO_FIELD && packet_id(packet, handler.client_field) >= clients.size()) return;
+  if(handler.session_field != NO_FIELD && packet_id(packet, handler.session_field) >= sessions.size()) return;
+
+  int owner = packet_shard(packet);
+  if(!(handler.flags & ROUTE_BY_ADDRESS) && owner != current_shard->id) {
+    // the client moved to another shard after this packet was routed
+    forward_packet(owner, packet);
+    return;
   }
-  return -1;
+
+  if((handler.flags & REQUIRES_SESSION) && client_session[packet_id(packet, handler.client_field)] == NO_SESSION) return;
+  if(handler.flags & FROM_MAIN) {
+    // only this shard's sessions can be read here
+    uint16_t session_id = packet_id(packet, handler.session_field);
+    if(session_shard(session_id) != current_shard->id || sessions[session_id].main != packet.sender) {
+      drop_packet(DROP_UNAUTHENTICATED, packet.type);
+      return;
+    }
+  }
+
+  handler.handle(packet);
+}
+
+uint16_t packet_id(packet::Packet &packet, uint8_t field) {
+  return packet::Field<uint16_t>::decode(&packet.data[field]);
 }
 
-void use_client(uint16_t id, sockaddr_in addr) {
+void handle_connect(packet::Packet &packet) {
+  // a retry whose CONNECTED got lost, or the same address connecting again, keeps its client.
+  // Looked up again here, an earlier CONNECT from the address may have been handled since
+  // the listener authenticated this one.
+  uint16_t sender = client_index.find(packet.clientaddr.sin_addr.s_addr, packet.clientaddr.sin_port);
+  if(sender != NO_CLIENT) {
+    int owner = client_owner[sender].load(std::memory_order_acquire);
+    if(owner != current_shard->id) {
+      forward_packet(owner, packet);
+      return;
+    }
+    if(!clients[sender].available) {
+      Endpoint addr{packet.clientaddr, packet.sockfd};
+      logger::log(logger::CLIENT_CONNECTED_RESEND, addr.addr.sin_addr.s_addr, sender);
+      set_client_msg_time(sender);
+      send_connected_packet(&addr, sender, packet::is_extended(packet));
+      return;
+    }
+  }
+
+  int next = (current_shard->id + 1) % SHARD_COUNT;
+  if(find_available_client_id(true) == -1 && next != packet_shard(packet)) {
+    // no free slot in this shard, let the next one try before giving up
+    forward_packet(next, packet);
+  } else {
+    // only clients sending the extended CONNECT get the extended CONNECTED back
+    bool negotiate = packet::is_extended(packet);
+    auto capabilities = negotiate ? std::get<0>(packet::decode_extended<packet::PacketType::CONNECT>(packet)) : packet::Capability(0);
+    connect_client(Endpoint{packet.clientaddr, packet.sockfd}, negotiate, capabilities);
+  }
+}
+
+void handle_disconnect(packet::Packet &packet) {
+  auto [client_id] = packet::decode<packet::PacketType::DISCONNECT>(packet);
+  disconnect_client(client_id, false);
+}
+
+void handle_create_session(packet::Packet &packet) {
+  auto [main_id] = packet::decode<packet::PacketType::CREATE_SESSION>(packet);
+  Client *client = &clients[main_id];
+  if(!client->available && client_session[main_id] == NO_SESSION && find_available_session_id() == -1) {
+    // the pool is full and this shard used its part, move the client to a shard with room
+    current_shard->out_of_sessions.store(true, std::memory_order_relaxed);
+    int target = shard_with_free_sessions();
+    if(target != -1) {
+      migrate_client(main_id, target);
+      forward_packet(target, packet);
+      return;
+    }
+  }
+  create_session(main_id);
+}
+
+void handle_assign_to_session(packet::Packet &packet) {
+  auto [client_id, session_id] = packet::decode<packet::PacketType::ASSIGN_TO_SESSION>(packet);
+  int target = session_shard(session_id);
+  if(target != current_shard->id) {
+    if(client_session[client_id] != NO_SESSION) {
+      logger::log(logger::ASSIGN_FAILED_OTHER_SESSION, client_id, session_id);
+      send_could_not_assign_to_session_packet(client_id, session_id);
+    } else {
+      // hand the client over to the shard owning the session, which finishes the assignment
+      migrate_client(client_id, target);
+      forward_packet(target, packet);
+    }
+    return;
+  }
+  assign_to_session(session_id, client_id);
+}
+
+void handle_disconnect_from_session(packet::Packet &packet) {
+  auto [session_id, client_id] = packet::decode<packet::PacketType::DISCONNECT_FROM_SESSION>(packet);
+  disconnect_from_session(session_id, client_id);
+}
+
+void handle_set_ready(packet::Packet &packet) {
+  auto [client_id, session_id, readiness] = packet::decode<packet::PacketType::SET_READY>(packet);
+  set_client_ready(client_id, session_id, readiness);
+}
+
+void handle_set_ball_pos(packet::Packet &packet) {
+  if(packet::is_extended(packet)) {
+    auto [session_id, ball_pos, ball_dir, seq] = packet::decode_extended<packet::PacketType::SET_BALL_POS>(packet);
+    set_ball_pos(session_id, ball_pos, ball_dir, seq);
+  } else {
+    auto [session_id, ball_pos, ball_dir] = packet::decode<packet::PacketType::SET_BALL_POS>(packet);
+    set_ball_pos(session_id, ball_pos, ball_dir, 0);
+  }
+}
+
+void handle_set_player_pos(packet::Packet &packet) {
+  if(packet::is_extended(packet)) {
+    auto [client_id, player_pos, player_dir, seq] = packet::decode_extended<packet::PacketType::SET_PLAYER_POS>(packet);
+    set_player_pos(client_id, player_pos, player_dir, seq);
+  } else {
+    auto [client_id, player_pos, player_dir] = packet::decode<packet::PacketType::SET_PLAYER_POS>(packet);
+    set_player_pos(client_id, player_pos, player_dir, 0);
+  }
+}
+
+void handle_point_scored(packet::Packet &packet) {
+  auto [session_id, client_id] = packet::decode<packet::PacketType::POINT_SCORED>(packet);
+  score_point(session_id, client_id);
+}
+
+void handle_im_alive(packet::Packet &packet) {
+  auto [client_id] = packet::decode<packet::PacketType::IM_ALIVE>(packet);
+  handle_client_alive(Endpoint{packet.clientaddr, packet.sockfd}, client_id, packet.sender);
+}
+
+void handle_snapshot_ack(packet::Packet &packet) {
+  auto [client_id, seq] = packet::decode<packet::PacketType::SNAPSHOT_ACK>(packet);
+  acknowledge_snapshot(client_id, seq);
+}
+
+// The envelope is acked even when it repeats one already handled, its first ack may have
+// been lost. Only the first copy reaches the handler of the packet inside.
+void handle_reliable(packet::Packet &packet) {
+  auto [client_id, seq] = packet::decode<packet::PacketType::RELIABLE>(packet);
+  Client *client = &clients[client_id];
+  if(client->available) return;
+
+  Endpoint addr{packet.clientaddr, packet.sockfd};
+  packet::encode<packet::PacketType::ACK>(queue_packet(&addr), client_id, seq);
+  if(!client->channel.received.accept(seq)) return;
+
+  packet::Packet inner = packet;
+  int pos = 0;
+  uint16_t header = packet::Schema<packet::PacketType::RELIABLE>::SIZE;
+  int crc_failures = 0;
+  bool parsed = packet::parse_packet(&packet.data[header], packet.size - header, pos, inner, crc_failures);
+  if(crc_failures > 0) metrics::count(metrics::CRC_FAILURES, crc_failures);
+  if(!parsed) return;
+  if(!packet::verify_packet(inner) || !(packet_handlers[inner.type].flags & CONTROL)) return;
+  // the envelope was authenticated, what it carries has to name the same client
+  if(!sender_allowed(inner)) {
+    drop_packet(DROP_UNAUTHENTICATED, inner.type);
+    return;
+  }
+  handle_packet(inner);
+}
+
+void handle_ack(packet::Packet &packet) {
+  auto [client_id, seq] = packet::decode<packet::PacketType::ACK>(packet);
+  Client *client = &clients[client_id];
+  if(client->available) return;
+
+  int64_t now = steady_now_ns();
+  client->channel.acknowledge(seq, now);
+  client->channel.promote(now, [client_id](reliable::Pending &entry) {
+    resend_control_packet(client_id, entry);
+  });
+  set_client_msg_time(client_id);
+}
+
+void send_packet(Endpoint *addr, packet::SendData &packet) {
+  *queue_packet(addr) = packet;
+}
+
+// encoded straight into the outbound batch, clients that negotiated RELIABLE_CONTROL get it
+// wrapped and sent again until they ack it
+template<packet::PacketType Type, typename... Args>
+void send_control_packet(uint16_t client_id, Args &&...args) {
+  if(!(clients[client_id].capabilities & packet::RELIABLE_CONTROL)) {
+    packet::encode<Type>(queue_packet(&client_addr[client_id]), std::forward<Args>(args)...);
+    return;
+  }
+  packet::SendData packet;
+  packet::encode<Type>(&packet, std::forward<Args>(args)...);
+  send_reliable_packet(client_id, packet);
+}
+
+// while the window is full the wrapped packet waits in the channel's queue for acks
+void send_reliable_packet(uint16_t client_id, packet::SendData &packet) {
+  reliable::Channel &channel = clients[client_id].channel;
+  uint32_t seq = channel.next_seq++;
+  if(channel.has_room()) {
+    packet::SendData *out = queue_packet(&client_addr[client_id]);
+    packet::wrap_reliable(out, client_id, seq, packet);
+    if(channel.add(seq, out->data, out->size, steady_now_ns())) track_retransmits(client_id);
+    return;
+  }
+  packet::SendData wrapped;
+  packet::wrap_reliable(&wrapped, client_id, seq, packet);
+  if(channel.enqueue(seq, wrapped.data, wrapped.size)) return;
+  // nowhere left to keep it, so it goes out once and may be lost
+  metrics::count(metrics::RELIABLE_OVERFLOWS);
+  logger::log(logger::RELIABLE_OVERFLOW, client_id);
+  send_packet(&client_addr[client_id], wrapped);
+}
+
+packet::SendData *queue_packet(Endpoint *addr) {
+  Shard *shard = current_shard;
+  if(shard->outbound_count == SEND_BATCH_SIZE) flush_outbound();
+  OutboundPacket *entry = &shard->outbound[shard->outbound_count++];
+  entry->addr = *addr;
+  return &entry->packet;
+}
+
+void flush_outbound() {
+  thread_local iovec iovecs[SEND_BATCH_SIZE];
+  thread_local mmsghdr msgs[SEND_BATCH_SIZE];
+  OutboundPacket *outbound = current_shard->outbound;
+  int &outbound_count = current_shard->outbound_count;
+
+  // one sendmmsg per socket, each packet leaves through the socket its client talks to
+  for(int listener = 0; listener < settings.listeners; listener++) {
+    int sockfd = sockfds[listener];
+    int count = 0;
+    for(int i = 0; i < outbound_count; i++) {
+      if(outbound[i].addr.sockfd != sockfd) continue;
+      iovecs[count].iov_base = outbound[i].packet.data;
+      iovecs[count].iov_len = outbound[i].packet.size;
+      memset(&msgs[count], 0, sizeof(mmsghdr));
+      msgs[count].msg_hdr.msg_name = &outbound[i].addr.addr;
+      msgs[count].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+      msgs[count].msg_hdr.msg_iov = &iovecs[count];
+      msgs[count].msg_hdr.msg_iovlen = 1;
+      count++;
+    }
+
+    int sent = 0;
+    while(sent < count) {
+      int n = sendmmsg(sockfd, &msgs[sent], count - sent, MSG_CONFIRM);
+      if(n <= 0) break; // udp gives no delivery guarantee anyway, so the rest of the batch is dropped
+      sent += n;
+    }
+    if(sent > 0) metrics::count(metrics::DATAGRAMS_SENT, sent);
+  }
+  outbound_count = 0;
+}
+
+// chunks are kept small enough for every shard to get one at startup
+void init_pools() {
+  clients.init(settings.clients, std::min(settings.pool_chunk, std::max<size_t>(1, settings.clients / SHARD_COUNT)), settings.huge_pages);
+  sessions.init(settings.sessions, std::min(settings.pool_chunk, std::max<size_t>(1, settings.sessions / SHARD_COUNT)), settings.huge_pages);
+  client_owner = std::make_unique<std::atomic<uint8_t>[]>(settings.clients);
+  session_owner = std::make_unique<std::atomic<uint8_t>[]>(settings.sessions);
+  client_session = std::make_unique_for_overwrite<uint16_t[]>(settings.clients);
+  client_addr = std::make_unique_for_overwrite<Endpoint[]>(settings.clients);
+  client_motion = std::make_unique_for_overwrite<Motion[]>(settings.clients);
+  client_index.init(settings.clients);
+  stale_timeout_ticks = settings.stale_time_s * 1000 / STALE_CHECK_INTERVAL_MS;
+  if(settings.tick_rate > 0) {
+    broadcast_interval = std::chrono::nanoseconds(1'000'000'000 / settings.tick_rate);
+    supported_capabilities |= packet::SESSION_SNAPSHOTS | packet::COMPACT_SNAPSHOTS;
+  }
+  snapshot_ranges.x = types::Range{settings.field_min_x, settings.field_max_x};
+  snapshot_ranges.y = types::Range{settings.field_min_y, settings.field_max_y};
+  snapshot_ranges.direction = types::Range{-settings.max_direction, settings.max_direction};
+}
+
+// every shard starts with one chunk of each, as far as the capacity goes
+void init_shards() {
+  // every listener has its own pair of rings into every shard
+  size_t ring_space = settings.max_packets / SHARD_COUNT / settings.listeners;
+  size_t control_size = std::max<size_t>(1, ring_space * CONTROL_LANE_PERCENT / 100);
+  size_t positions_size = std::max<size_t>(1, ring_space - std::min(ring_space, control_size));
+  for(int i = 0; i < SHARD_COUNT; i++) {
+    shards[i].id = i;
+    for(int listener = 0; listener < settings.listeners; listener++) {
+      shards[i].control[listener].init(control_size);
+      shards[i].positions[listener].init(positions_size);
+    }
+    shards[i].client_expiry.start(current_tick());
+    grow_clients(&shards[i]);
+    grow_sessions(&shards[i]);
+  }
+}
+
+// the new slots belong to the growing shard. They are pushed from the highest id down,
+// so the lowest free id is handed out first.
+bool grow_clients(Shard *shard) {
+  return clients.grow([shard](size_t id, Client &client) {
+    client.id = id;
+    client.available = true;
+    client.wheel_bucket = -1;
+    client.retransmit_shard = -1;
+    client_session[id] = NO_SESSION;
+    client_owner[id].store(shard->id, std::memory_order_relaxed);
+    shard->free_clients.push(&client);
+  });
+}
+
+bool grow_sessions(Shard *shard) {
+  return sessions.grow([shard](size_t id, Session &session) {
+    session.id = id;
+    session.available = true;
+    session.main = NO_CLIENT;
+    session.secondary = NO_CLIENT;
+    session_owner[id].store(shard->id, std::memory_order_relaxed);
+    shard->free_sessions.push(&session);
+  });
+}
+
+// stale clients are only replaced once the pool cannot grow any more
+int find_available_client_id(bool include_scheduled_to_disconnect) {
+  if(current_shard->free_clients.empty()) grow_clients(current_shard);
+  Client *client = current_shard->free_clients.front();
+  if(client == nullptr && include_scheduled_to_disconnect) client = current_shard->stale_clients.front();
+  return client != nullptr ? client->id : -1;
+}
+
+int find_available_session_id() {
+  if(current_shard->free_sessions.empty()) grow_sessions(current_shard);
+  Session *session = current_shard->free_sessions.front();
+  return session != nullptr ? session->id : -1;
+}
+
+void use_client(uint16_t id, Endpoint addr) {
   Client *client = &clients[id];
+  if(client->available) {
+    current_shard->free_clients.remove(client);
+    metrics::change(metrics::ACTIVE_CLIENTS, 1);
+  } else if(client->scheduled_to_disconnect) {
+    current_shard->stale_clients.remove(client);
+  }
   client->available = false;
-  client->last_msg_timestamp = std::chrono::system_clock::now();
-  client->addr = addr;
+  client_addr[id] = addr;
   client->scheduled_to_disconnect = false;
+  client->position_seq = 0;
+  client->channel.reset();
+  set_client_msg_time(id);
 }
 
 void use_session(uint16_t id, uint16_t main_id) {
-  sessions[id].available = false;
-  sessions[id].main = &clients[main_id];
+  Session *session = &sessions[id];
+  if(session->available) {
+    current_shard->free_sessions.remove(session);
+    metrics::change(metrics::ACTIVE_SESSIONS, 1);
+  }
+  session->available = false;
+  session->main = main_id;
+  session->main_addr = client_addr[main_id];
+  session->main_capabilities = clients[main_id].capabilities;
+  session->main_acked = 0;
+  session->ball_seq = 0;
 }
 
+// only touches the clients whose timeout passed since the last check
 void disconnect_stale_clients() {
-  auto end = std::chrono::system_clock::now();
-  for(int id = 0; id < CLIENT_COUNT; id++) {
-    if(!clients[id].available) {
-      std::chrono::duration<double> elapsed_seconds = end - clients[id].last_msg_timestamp;
-      if(elapsed_seconds.count() > MAX_STALE_TIME_S) {
-        clients[id].scheduled_to_disconnect = true;
-      }
-    }
-  }
+  current_shard->client_expiry.advance(current_tick(), [](Client *client) {
+    client->scheduled_to_disconnect = true;
+    current_shard->stale_clients.push(client);
+    metrics::count(metrics::CLIENTS_STALE);
+  });
 }
 
 void disconnect_client(uint16_t id, bool inform) {
   Client *client = &clients[id];
   if(clients[id].available == true) {
-    log_message("Tried to disconnect already disconnected client (id = " + std::to_string(id) + ")");
+    logger::log(logger::CLIENT_ALREADY_DISCONNECTED, id);
     return;
   }
-  packet::SendData packet;
-  packet::make_disconnected_packet(&packet);
-  sockaddr_in client_addr = client->addr;
-  if(client->session != nullptr) {
-    disconnect_from_session(client->session->id, id);
+  Endpoint addr = client_addr[id];
+  if(client_session[id] != NO_SESSION) {
+    disconnect_from_session(client_session[id], id);
+  }
+  if(client->scheduled_to_disconnect) {
+    current_shard->stale_clients.remove(client);
+    client->scheduled_to_disconnect = false;
   }
+  current_shard->client_expiry.remove(client);
+  client->channel.reset(); // whatever is still unacked dies with the client
+  client_index.erase(addr.addr.sin_addr.s_addr, addr.addr.sin_port, id);
   client->available = true;
-  if(inform) send_packet(&client_addr, packet);
-  log_message("Disconnected client (id = " + std::to_string(id) + ")");
+  current_shard->free_clients.push(client);
+  metrics::change(metrics::ACTIVE_CLIENTS, -1);
+  if(inform) send_disconnected_packet(&addr);
+  logger::log(logger::CLIENT_DISCONNECTED, id);
 }
 
 void destroy_session(uint16_t id) {
   Session *session = &sessions[id];
+  if(session->dirty != 0) {
+    current_shard->dirty_sessions.remove(session);
+    session->dirty = 0;
+  }
+  if(!session->available) metrics::change(metrics::ACTIVE_SESSIONS, -1);
   session->available = true;
-  session->main = nullptr;
-  session->secondary = nullptr;
-  session->game_active = false;
-  log_message("Destroyed session (session_id = " + std::to_string(id) + ")");
+  current_shard->free_sessions.push(session);
+  current_shard->out_of_sessions.store(false, std::memory_order_relaxed);
+  session->main = NO_CLIENT;
+  session->secondary = NO_CLIENT;
+  set_game_active(session, false);
+  logger::log(logger::SESSION_DESTROYED, id);
 }
 
-void connect_client(sockaddr_in addr) {
+void connect_client(Endpoint addr, bool negotiate, packet::Capability capabilities) {
   int available_id = find_available_client_id(true);
-  packet::SendData response;
-  if(available_id != -1) {
-    if(clients[available_id].scheduled_to_disconnect) {
-        log_message("Disconnected stale client when new tried to connect on id = " + std::to_string(available_id));
-        disconnect_client(available_id, true);
-    }
+  if(available_id != -1 && clients[available_id].scheduled_to_disconnect) {
+    logger::log(logger::STALE_CLIENT_REPLACED, available_id);
+    metrics::count(metrics::STALE_DISCONNECTS);
+    disconnect_client(available_id, true);
+  }
+  // the index refuses an address it already maps, so one address never gets two clients
+  if(available_id != -1 && client_index.insert(addr.addr.sin_addr.s_addr, addr.addr.sin_port, available_id)) {
     use_client(available_id, addr);
-    packet::make_connected_packet(&response, available_id);
-    char *ip = inet_ntoa(addr.sin_addr);
-    log_message("Client (" + std::string(ip) + ") connected: " + std::to_string(available_id));
+    clients[available_id].capabilities = capabilities & supported_capabilities;
+    logger::log(logger::CLIENT_CONNECTED, addr.addr.sin_addr.s_addr, available_id);
+    send_connected_packet(&addr, available_id, negotiate);
   } else {
-    packet::make_could_not_connect_packet(&response);
-    log_message("Failed to connect the client");
-  }
-  send_packet(&addr, response);
-}
-
-void log_message(std::string message) {
-  auto t = std::time(nullptr);
-  auto tm = *std::localtime(&t);
-  std::ostringstream oss;
-  oss << std::put_time(&tm, "%d-%m-%Y %H-%M-%S");
-  {
-    lock_guard lock(log_mutex);
-    logs.push(oss.str() + ": " + message);
-  }
-  sem_post(&logs_available);
-}
-
-void process_logs() {
-  std::string log_message;
-
-  while(server_running) {
-    sem_wait(&logs_available);
-    {
-      lock_guard lock(log_mutex);
-      log_message = logs.front();
-      logs.pop();
-    }
-
-    std::cout << log_message << "\n";
+    logger::log(logger::CONNECT_FAILED);
+    send_could_not_connect_packet(&addr);
   }
 }
 
@@ -480,114 +1386,118 @@ void create_session(uint16_t main_id) {
 
   int available_id = find_available_session_id();
   Client *client = &clients[main_id];
-  packet::SendData packet;
   if(available_id != -1 && !client->available) {
-    if(client->session != nullptr) {
-      log_message("RESEND: Created session (session_id = "+std::to_string(available_id)+") and assigned client (client_id = "+std::to_string(main_id)+") as main.");
-      packet::make_assigned_to_session_packet(&packet, available_id, main_id, packet::ClientType::MAIN);
+    if(client_session[main_id] != NO_SESSION) {
+      logger::log(logger::SESSION_CREATED_RESEND, available_id, main_id);
     } else {
       use_session(available_id, main_id);
-      client->session = &sessions[available_id];
-      log_message("Created session (session_id = "+std::to_string(available_id)+") and assigned client (client_id = "+std::to_string(main_id)+") as main.");
-      packet::make_assigned_to_session_packet(&packet, available_id, main_id, packet::ClientType::MAIN);
+      client_session[main_id] = available_id;
+      logger::log(logger::SESSION_CREATED, available_id, main_id);
     }
+    send_assigned_to_session_packet(main_id, available_id, main_id, packet::ClientType::MAIN);
   } else {
-    log_message("Failed at creating session.");
-    packet::make_could_not_create_session_packet(&packet);
+    logger::log(logger::SESSION_CREATE_FAILED);
+    send_could_not_create_session(main_id);
   }
-  send_packet(&clients[main_id].addr, packet);
 }
 
 void disconnect_from_session(uint16_t session_id, uint16_t client_id) {
   Session *session = &sessions[session_id];
-  Client *client = &clients[client_id];
-  Client *main = session->main;
-  Client *secondary = session->secondary;
 
   set_client_msg_time(client_id);
 
-  packet::SendData packet;
+  // a session the client is not in may be owned by another shard, so it is not touched here
+  if(client_session[client_id] != session_id) { // client did not receive last message about status
+    logger::log(logger::LEFT_SESSION_RESEND, client_id, session_id);
+    send_session_disconnect_status_packet(client_id, session_id, client_id, packet::SessionDisconnectStatus::SUCCESS);
+    return;
+  }
 
   if(!session->available) {  
-    bool has_main = main != nullptr;
-    bool has_secondary = secondary != nullptr;
-
-    if(main == client) {
-      main->ready = false;
-      log_message("Disconnected client (client_id = "+std::to_string(client_id)+") from session (session_id = "+std::to_string(session_id)+")");
-      packet::make_session_disconnect_status_packet(&packet, session_id, client_id, packet::SessionDisconnectStatus::SUCCESS);
-      main->session = nullptr;
-      session->main = nullptr;
-      send_packet(&client->addr, packet);
+    bool has_main = session->main != NO_CLIENT;
+    bool has_secondary = session->secondary != NO_CLIENT;
+
+    if(session->main == client_id) {
+      clients[client_id].ready = false;
+      logger::log(logger::LEFT_SESSION, client_id, session_id);
+      client_session[client_id] = NO_SESSION;
+      session->main = NO_CLIENT;
+      send_session_disconnect_status_packet(client_id, session_id, client_id, packet::SessionDisconnectStatus::SUCCESS);
       if(has_secondary) {
-        secondary->ready = false;
-        log_message("Client (client_id = "+std::to_string(secondary->id)+") became MAIN in session (session_id = "+std::to_string(session_id)+")");
-        send_packet(&secondary->addr, packet);
-        session->main = secondary;
-        session->secondary = nullptr;
+        clients[session->secondary].ready = false;
+        logger::log(logger::BECAME_MAIN, session->secondary, session_id);
+        send_session_disconnect_status_packet(session->secondary, session_id, client_id, packet::SessionDisconnectStatus::SUCCESS);
+        session->main = session->secondary;
+        session->main_addr = session->secondary_addr;
+        session->main_capabilities = session->secondary_capabilities;
+        session->main_acked = session->secondary_acked;
+        session->ball_seq = 0; // the new main numbers its own updates
+        session->secondary = NO_CLIENT;
       } else {
         destroy_session(session_id);
       }
-    } else if(secondary == client) {
-      secondary->ready = false;
-      log_message("Disconnected client (client_id = "+std::to_string(client_id)+") from session (session_id = "+std::to_string(session_id)+")");
-      packet::make_session_disconnect_status_packet(&packet, session_id, client_id, packet::SessionDisconnectStatus::SUCCESS);
-      secondary->session = nullptr;
-      session->secondary = nullptr;
-      send_packet(&client->addr, packet);
+    } else if(session->secondary == client_id) {
+      clients[client_id].ready = false;
+      logger::log(logger::LEFT_SESSION, client_id, session_id);
+      client_session[client_id] = NO_SESSION;
+      session->secondary = NO_CLIENT;
+      send_session_disconnect_status_packet(client_id, session_id, client_id, packet::SessionDisconnectStatus::SUCCESS);
       if(has_main) {
-        main->ready = false;
-        send_packet(&main->addr, packet);
+        clients[session->main].ready = false;
+        send_session_disconnect_status_packet(session->main, session_id, client_id, packet::SessionDisconnectStatus::SUCCESS);
       }
     } else { // if there are no players in session then it means that client did not receive last message about status
-      log_message("RESEND: Disconnected client (client_id = "+std::to_string(client_id)+") from session (session_id = "+std::to_string(session_id)+")");
-      packet::make_session_disconnect_status_packet(&packet, session_id, client_id, packet::SessionDisconnectStatus::SUCCESS);
-      send_packet(&client->addr, packet);
+      logger::log(logger::LEFT_SESSION_RESEND, client_id, session_id);
+      send_session_disconnect_status_packet(client_id, session_id, client_id, packet::SessionDisconnectStatus::SUCCESS);
     }
   } else { // if session is available that means that client did not receive last message about status
-    log_message("RESEND: Disconnected client (client_id = "+std::to_string(client_id)+") from session (session_id = "+std::to_string(session_id)+")");
-    packet::make_session_disconnect_status_packet(&packet, session_id, client_id, packet::SessionDisconnectStatus::SUCCESS);
-    send_packet(&client->addr, packet);
+    logger::log(logger::LEFT_SESSION_RESEND, client_id, session_id);
+    send_session_disconnect_status_packet(client_id, session_id, client_id, packet::SessionDisconnectStatus::SUCCESS);
   }
 }
 
 void assign_to_session(uint16_t session_id, uint16_t client_id) {
   Session *session = &sessions[session_id];
-  Client *client = &clients[client_id];
 
   set_client_msg_time(client_id);
 
-  packet::SendData packet;
-
   if(session->available) {
-    log_message("Failed assigning client (client_id = "+std::to_string(client_id)+") to session (session_id = "+std::to_string(session_id)+"). Session is not used.");
-    send_could_not_assign_to_session_packet(&client->addr, session_id);
+    logger::log(logger::ASSIGN_FAILED_SESSION_NOT_USED, client_id, session_id);
+    send_could_not_assign_to_session_packet(client_id, session_id);
+    return;
+  }
+
+  if(client_session[client_id] != NO_SESSION && client_session[client_id] != session_id) {
+    logger::log(logger::ASSIGN_FAILED_OTHER_SESSION, client_id, session_id);
+    send_could_not_assign_to_session_packet(client_id, session_id);
     return;
   }
 
-  bool has_main = session->main != nullptr;
-  bool has_secondary = session->secondary != nullptr;
+  bool has_main = session->main != NO_CLIENT;
+  bool has_secondary = session->secondary != NO_CLIENT;
 
   if(has_main && has_secondary) { // both places are occupied
-    if(session->main == client) {
-      log_message("RESEND: Assigned client (client_id = "+std::to_string(client_id)+") to session (session_id = "+std::to_string(session_id)+") as main");
-      send_assigned_to_session_packet(&client->addr, session_id, client_id, packet::ClientType::MAIN);
-    } else if(session->secondary != client) {
-      log_message("RESEND: Assigned client (client_id = "+std::to_string(client_id)+") to session (session_id = "+std::to_string(session_id)+") as secondary");
-      send_assigned_to_session_packet(&client->addr, session_id, client_id, packet::ClientType::SECONDARY);
-      send_assigned_to_session_packet(&client->addr, session_id, session->main->id, packet::ClientType::MAIN);
+    if(session->main == client_id) {
+      logger::log(logger::ASSIGNED_AS_MAIN_RESEND, client_id, session_id);
+      send_assigned_to_session_packet(client_id, session_id, client_id, packet::ClientType::MAIN);
+    } else if(session->secondary != client_id) {
+      logger::log(logger::ASSIGNED_AS_SECONDARY_RESEND, client_id, session_id);
+      send_assigned_to_session_packet(client_id, session_id, client_id, packet::ClientType::SECONDARY);
+      send_assigned_to_session_packet(client_id, session_id, session->main, packet::ClientType::MAIN);
     } else {
-      log_message("Failed assigning client (client_id = "+std::to_string(client_id)+") to session (session_id = "+std::to_string(session_id)+"). Session is full.");
-      send_could_not_assign_to_session_packet(&client->addr, session_id);
+      logger::log(logger::ASSIGN_FAILED_SESSION_FULL, client_id, session_id);
+      send_could_not_assign_to_session_packet(client_id, session_id);
     }
   } else { // assign secondary
-    log_message("Assigned client (client_id = "+std::to_string(client_id)+") to session (session_id = "+std::to_string(session_id)+") as secondary");
-    packet::make_assigned_to_session_packet(&packet, session_id, client_id, packet::ClientType::SECONDARY);
-    session->secondary = client;
-    client->session = session;
-    send_packet(&session->main->addr, packet);
-    send_packet(&session->secondary->addr, packet);
-    send_assigned_to_session_packet(&client->addr, session_id, session->main->id, packet::ClientType::MAIN);
+    logger::log(logger::ASSIGNED_AS_SECONDARY, client_id, session_id);
+    session->secondary = client_id;
+    session->secondary_addr = client_addr[client_id];
+    session->secondary_capabilities = clients[client_id].capabilities;
+    session->secondary_acked = 0;
+    client_session[client_id] = session_id;
+    send_assigned_to_session_packet(session->main, session_id, client_id, packet::ClientType::SECONDARY);
+    send_assigned_to_session_packet(client_id, session_id, client_id, packet::ClientType::SECONDARY);
+    send_assigned_to_session_packet(client_id, session_id, session->main, packet::ClientType::MAIN);
   } // does not need to assign main. Every session has main if it's available.
 }
 
@@ -597,70 +1507,80 @@ void set_client_ready(uint16_t client_id, uint16_t session_id, packet::Readiness
 
   set_client_msg_time(client_id);
 
-  bool has_main = session->main != nullptr;
-  bool has_secondary = session->secondary != nullptr;
+  // a session the client is not in may be owned by another shard
+  if(client->available || client_session[client_id] != session_id) return;
 
-  Client *main = session->main, *secondary = session->secondary;
+  bool has_main = session->main != NO_CLIENT;
+  bool has_secondary = session->secondary != NO_CLIENT;
 
-  if(!client->available && client->session == session) {
-    if(client->session->game_active) {
-      log_message("Game session id = " + std::to_string(session->id) +  " already started");
-      send_game_started_packet(&main->addr, session_id);
-      send_game_started_packet(&secondary->addr, session_id);
-      return;
-    }
+  if(session->game_active) {
+    logger::log(logger::GAME_ALREADY_STARTED, session->id);
+    send_game_started_packet(session->main, session_id);
+    send_game_started_packet(session->secondary, session_id);
+    return;
+  }
 
-    client->ready = readiness == packet::Readiness::READY;
+  client->ready = readiness == packet::Readiness::READY;
 
-    if(main == client && has_secondary) {
-      send_inform_client_ready_packet(&client->addr, session_id, client_id, readiness);
-      send_inform_client_ready_packet(&secondary->addr, session_id, client_id, readiness);
-    } else {
-      send_inform_client_ready_packet(&client->addr, session_id, client_id, readiness);
-      send_inform_client_ready_packet(&main->addr, session_id, client_id, readiness);
-    }
+  if(session->main == client_id && has_secondary) {
+    send_inform_client_ready_packet(client_id, session_id, client_id, readiness);
+    send_inform_client_ready_packet(session->secondary, session_id, client_id, readiness);
+  } else {
+    send_inform_client_ready_packet(client_id, session_id, client_id, readiness);
+    send_inform_client_ready_packet(session->main, session_id, client_id, readiness);
+  }
 
-    if(has_main && has_secondary && main->ready && secondary->ready) {
-      session->game_active = true;
-      log_message("Game session id = " + std::to_string(session->id) +  " just started");
-      main->score = 0;
-      secondary->score = 0;
-      send_game_started_packet(&main->addr, session_id);
-      send_game_started_packet(&secondary->addr, session_id);
-    }
+  if(has_main && has_secondary && clients[session->main].ready && clients[session->secondary].ready) {
+    set_game_active(session, true);
+    logger::log(logger::GAME_STARTED, session->id);
+    clients[session->main].score = 0;
+    clients[session->secondary].score = 0;
+    send_game_started_packet(session->main, session_id);
+    send_game_started_packet(session->secondary, session_id);
   }
 }
 
-void set_ball_pos(uint16_t session_id, types::Vector2 &ball_pos, types::Vector2 &ball_dir) {
+void set_ball_pos(uint16_t session_id, types::Vector2 &ball_pos, types::Vector2 &ball_dir, uint32_t seq) {
   Session *session = &sessions[session_id];
 
   if(session->game_active) {
+    set_client_msg_time(session->main);
+
+    if(is_stale(seq, session->ball_seq)) {
+      metrics::count(metrics::STALE_BALL_UPDATES);
+      return;
+    }
+
     session->ball_pos = ball_pos;
     session->ball_dir = ball_dir;
 
-    set_client_msg_time(session->main->id);
-
-    send_ball_pos_packet(&session->secondary->addr, session);
+    mark_session_dirty(session, BALL_MOVED);
   }
 }
 
-void set_player_pos(uint16_t client_id, types::Vector2 &player_pos, types::Vector2 &player_dir) {
-  Client *client = &clients[client_id];
-  Session *session = client->session;
+void set_player_pos(uint16_t client_id, types::Vector2 &player_pos, types::Vector2 &player_dir, uint32_t seq) {
+  uint16_t session_id = client_session[client_id];
 
   set_client_msg_time(client_id);
 
-  if(client->available) return;
-  if(session == nullptr) return;
+  if(session_id == NO_SESSION) return;
+  if(is_stale(seq, clients[client_id].position_seq)) {
+    metrics::count(metrics::STALE_PLAYER_UPDATES);
+    return;
+  }
+  Session *session = &sessions[session_id];
 
-  client->pos = player_pos;
-  client->dir = player_dir;
+  client_motion[client_id] = Motion{player_pos, player_dir};
+  mark_session_dirty(session, client_id == session->main ? MAIN_MOVED : SECONDARY_MOVED);
+}
 
-  if(client != session->main) {
-    send_player_pos_packet(&session->main->addr, client);
-  } else {
-    send_player_pos_packet(&session->secondary->addr, client);
-  }
+// Sequence numbers are compared with wraparound. 0 means the packet has none and is
+// always applied, otherwise anything not newer than last is stale.
+bool is_stale(uint32_t seq, uint32_t &last) {
+  if(seq == 0) return false;
+  if(last != 0 && (int32_t)(seq - last) <= 0) return true;
+  last = seq;
+  return false;
 }
 
 void score_point(uint16_t session_id, uint16_t client_id) {
@@ -669,27 +1589,112 @@ void score_point(uint16_t session_id, uint16_t client_id) {
 
   set_client_msg_time(client_id);
 
+  if(client->available || client_session[client_id] != session_id) return;
   if(session->available || !session->game_active) return;
-  if(client->available || client->session != session) return;
 
   client->score++;
 
-  if(session->main->score >= POINTS_TO_WIN) {
-    session->game_active = false;
+  if(clients[session->main].score >= POINTS_TO_WIN) {
+    set_game_active(session, false);
     send_player_won_packet(session, session->main);
-  } else if(session->secondary->score >= POINTS_TO_WIN) {
-    session->game_active = false;
+  } else if(clients[session->secondary].score >= POINTS_TO_WIN) {
+    set_game_active(session, false);
     send_player_won_packet(session, session->secondary);
   } else {
-    send_point_scored_packet(&session->secondary->addr, session, client->id);
+    send_point_scored_packet(session->secondary, session, client_id);
   }
 }
 
-void handle_client_alive(sockaddr_in addr, uint16_t client_id) {
+// in tick mode updates only overwrite the state, broadcast_positions sends the latest of it
+void set_game_active(Session *session, bool active) {
+  if(session->game_active != active) metrics::change(metrics::ACTIVE_GAMES, active ? 1 : -1);
+  session->game_active = active;
+}
+
+void mark_session_dirty(Session *session, uint8_t changes) {
+  if(session->dirty == 0) current_shard->dirty_sessions.push(session);
+  session->dirty |= changes;
+}
+
+// Sent once per tick, or per processing pass without a tick rate. Players that negotiated
+// snapshots get the whole state in a COMPACT_SNAPSHOT or SESSION_SNAPSHOT, the others the
+// peer's position, plus the ball for the secondary. Both go in one datagram only to clients
+// that negotiated PACKED_DATAGRAMS, older clients read just the first packet of a datagram.
+void broadcast_positions() {
+  Session *session;
+  while((session = current_shard->dirty_sessions.front()) != nullptr) {
+    current_shard->dirty_sessions.remove(session);
+    uint8_t changes = session->dirty;
+    session->dirty = 0;
+    if(session->main == NO_CLIENT || session->secondary == NO_CLIENT) continue;
+
+    uint8_t capabilities = session->main_capabilities | session->secondary_capabilities;
+    packet::Snapshot snapshot;
+    if(capabilities & (packet::SESSION_SNAPSHOTS | packet::COMPACT_SNAPSHOTS)) {
+      Motion &main = client_motion[session->main];
+      Motion &secondary = client_motion[session->secondary];
+      snapshot = packet::Snapshot{++session->snapshot_seq, session->ball_pos, session->ball_dir, main.pos, main.dir, secondary.pos, secondary.dir};
+    }
+    if(capabilities & packet::COMPACT_SNAPSHOTS) {
+      packet::quantize_snapshot(snapshot, snapshot_ranges, session->history[snapshot.seq % SNAPSHOT_HISTORY]);
+    }
+
+    if(session->main_capabilities & packet::COMPACT_SNAPSHOTS) {
+      send_compact_snapshot(&session->main_addr, session, session->main_acked);
+    } else if(session->main_capabilities & packet::SESSION_SNAPSHOTS) {
+      packet::encode_snapshot(queue_packet(&session->main_addr), snapshot);
+    } else if(changes & SECONDARY_MOVED) {
+      send_player_pos_packet(&session->main_addr, session->secondary);
+    }
+
+    if(session->secondary_capabilities & packet::COMPACT_SNAPSHOTS) {
+      send_compact_snapshot(&session->secondary_addr, session, session->secondary_acked);
+    } else if(session->secondary_capabilities & packet::SESSION_SNAPSHOTS) {
+      packet::encode_snapshot(queue_packet(&session->secondary_addr), snapshot);
+    } else if(session->secondary_capabilities & packet::PACKED_DATAGRAMS) {
+      if(changes & (MAIN_MOVED | BALL_MOVED)) {
+        packet::SendData *packet = queue_packet(&session->secondary_addr);
+        packet->size = 0;
+        if(changes & MAIN_MOVED) {
+          Motion &motion = client_motion[session->main];
+          packet::append<packet::PacketType::INFORM_PLAYER_POS>(packet, session->main, motion.pos, motion.dir);
+        }
+        if(changes & BALL_MOVED) {
+          packet::append<packet::PacketType::INFORM_BALL_POS>(packet, session->ball_pos, session->ball_dir);
+        }
+      }
+    } else {
+      if(changes & MAIN_MOVED) send_player_pos_packet(&session->secondary_addr, session->main);
+      if(changes & BALL_MOVED) send_ball_pos_packet(&session->secondary_addr, session);
+    }
+  }
+}
+
+// deltas against the snapshot the player acknowledged last, a whole one when there is none
+// or it already left the history
+void send_compact_snapshot(Endpoint *addr, Session *session, uint32_t acked) {
+  packet::QuantizedSnapshot *base = &session->history[acked % SNAPSHOT_HISTORY];
+  if(acked == 0 || base->seq != acked) base = nullptr;
+  packet::encode_compact_snapshot(queue_packet(addr), session->history[session->snapshot_seq % SNAPSHOT_HISTORY], base);
+}
+
+// acks may come late or out of order, only a newer one than the last moves the base
+void acknowledge_snapshot(uint16_t client_id, uint32_t seq) {
+  Session *session = &sessions[client_session[client_id]];
+
+  set_client_msg_time(client_id);
+
+  if(seq > session->snapshot_seq) return;
+  uint32_t *acked = client_id == session->main ? &session->main_acked : &session->secondary_acked;
+  if(seq > *acked) *acked = seq;
+}
+
+// a client that was disconnected, or whose id went to someone else, learns it is gone
+void handle_client_alive(Endpoint addr, uint16_t client_id, uint16_t sender) {
   Client *client = &clients[client_id];
 
-  if(client->available) {
-    log_message("Send info that client " + std::to_string(client_id) + " is not available.");
+  if(client->available || sender != client_id) {
+    logger::log(logger::CLIENT_NOT_AVAILABLE, client_id);
     send_disconnected_packet(&addr);
     return;
   }
@@ -698,85 +1703,122 @@ void handle_client_alive(sockaddr_in addr, uint16_t client_id) {
 }
 
 void set_client_msg_time(uint16_t client_id) {
-  clients[client_id].last_msg_timestamp = std::chrono::system_clock::now();
+  Client *client = &clients[client_id];
+  if(client->available) return;
+
+  if(client->scheduled_to_disconnect) {
+    current_shard->stale_clients.remove(client);
+    client->scheduled_to_disconnect = false;
+  }
+  // the deadline is rounded up to the next tick, so a client is never marked early
+  current_shard->client_expiry.schedule(client, current_tick() + stale_timeout_ticks + 1);
+}
+
+int64_t steady_now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void track_retransmits(uint16_t client_id) {
+  Client *client = &clients[client_id];
+  if(client->retransmit_shard == current_shard->id) return;
+  client->retransmit_shard = current_shard->id;
+  current_shard->retransmit_clients.push_back(client_id);
+}
+
+void untrack_retransmits(uint16_t client_id) {
+  Client *client = &clients[client_id];
+  if(client->retransmit_shard != current_shard->id) return;
+  client->retransmit_shard = -1;
+  auto &ids = current_shard->retransmit_clients;
+  ids.erase(std::find(ids.begin(), ids.end(), client_id));
+}
+
+// clients leave the list once nothing of theirs waits for an ack
+void retransmit_control_packets() {
+  int64_t now = steady_now_ns();
+  auto &ids = current_shard->retransmit_clients;
+  for(size_t i = 0; i < ids.size();) {
+    uint16_t id = ids[i];
+    Client *client = &clients[id];
+    auto resend = [id](reliable::Pending &entry) {
+      resend_control_packet(id, entry);
+    };
+    client->channel.retransmit(now, resend);
+    // packets given up on make room for queued ones
+    client->channel.promote(now, resend);
+    if(client->channel.pending_count > 0) {
+      i++;
+      continue;
+    }
+    client->retransmit_shard = -1;
+    ids[i] = ids.back();
+    ids.pop_back();
+  }
+}
+
+// a kept packet as it was first sent, already wrapped
+void resend_control_packet(uint16_t client_id, reliable::Pending &entry) {
+  packet::SendData *packet = queue_packet(&client_addr[client_id]);
+  memcpy(packet->data, entry.data, entry.size);
+  packet->size = entry.size;
 }
 
 // send packet functions
-void send_connected_packet(sockaddr_in *addr, uint16_t client_id) {
-  packet::SendData packet;
-  packet::make_connected_packet(&packet, client_id);
-  send_packet(addr, packet);
+void send_connected_packet(Endpoint *addr, uint16_t client_id, bool negotiate) {
+  if(negotiate) {
+    packet::Capability agreed = packet::Capability(clients[client_id].capabilities);
+    packet::encode_extended<packet::PacketType::CONNECTED>(queue_packet(addr), client_id, agreed);
+  } else {
+    packet::encode<packet::PacketType::CONNECTED>(queue_packet(addr), client_id);
+  }
 }
 
-void send_could_not_connect_packet(sockaddr_in *addr) {
-  packet::SendData packet;
-  packet::make_could_not_connect_packet(&packet);
-  send_packet(addr, packet);
+void send_could_not_connect_packet(Endpoint *addr) {
+  packet::encode<packet::PacketType::COULD_NOT_CONNECT>(queue_packet(addr));
 }
 
-void send_disconnected_packet(sockaddr_in *addr) {
-  packet::SendData packet;
-  packet::make_disconnected_packet(&packet);
-  send_packet(addr, packet);
+void send_disconnected_packet(Endpoint *addr) {
+  packet::encode<packet::PacketType::DISCONNECTED>(queue_packet(addr));
 }
 
-void send_assigned_to_session_packet(sockaddr_in *addr, uint16_t session_id, uint16_t client_id, packet::ClientType type) {
-  packet::SendData packet;
-  packet::make_assigned_to_session_packet(&packet, session_id, client_id, type);
-  send_packet(addr, packet);
+void send_assigned_to_session_packet(uint16_t to, uint16_t session_id, uint16_t client_id, packet::ClientType type) {
+  send_control_packet<packet::PacketType::ASSIGNED_TO_SESSION>(to, session_id, client_id, type);
 }
 
-void send_could_not_create_session(sockaddr_in *addr) {
-  packet::SendData packet;
-  packet::make_could_not_create_session_packet(&packet);
-  send_packet(addr, packet);
+void send_could_not_create_session(uint16_t to) {
+  send_control_packet<packet::PacketType::COULD_NOT_CREATE_SESSION>(to);
 }
 
-void send_session_disconnect_status_packet(sockaddr_in *addr, uint16_t session_id, uint16_t client_id, packet::SessionDisconnectStatus status) {
-  packet::SendData packet;
-  packet::make_session_disconnect_status_packet(&packet, session_id, client_id, status);
-  send_packet(addr, packet);
+void send_session_disconnect_status_packet(uint16_t to, uint16_t session_id, uint16_t client_id, packet::SessionDisconnectStatus status) {
+  send_control_packet<packet::PacketType::SESSION_DISCONNECT_STATUS>(to, session_id, client_id, status);
 }
 
-void send_could_not_assign_to_session_packet(sockaddr_in *addr, uint16_t session_id) {
-  packet::SendData packet;
-  packet::make_could_not_assign_to_session_packet(&packet, session_id);
-  send_packet(addr, packet);
+void send_could_not_assign_to_session_packet(uint16_t to, uint16_t session_id) {
+  send_control_packet<packet::PacketType::COULD_NOT_ASSIGN_TO_SESSION>(to, session_id);
 }
 
-void send_inform_client_ready_packet(sockaddr_in *addr, uint16_t session_id, uint16_t client_id, packet::Readiness readiness) {
-  packet::SendData packet;
-  packet::make_inform_client_ready_packet(&packet, session_id, client_id, readiness);
-  send_packet(addr, packet);
+void send_inform_client_ready_packet(uint16_t to, uint16_t session_id, uint16_t client_id, packet::Readiness readiness) {
+  send_control_packet<packet::PacketType::INFORM_CLIENT_READY>(to, session_id, client_id, readiness);
 }
 
-void send_game_started_packet(sockaddr_in *addr, uint16_t session_id) {
-  packet::SendData packet;
-  packet::make_game_started_packet(&packet, session_id);
-  send_packet(addr, packet);
+void send_game_started_packet(uint16_t to, uint16_t session_id) {
+  send_control_packet<packet::PacketType::GAME_STARTED>(to, session_id);
 }
 
-void send_ball_pos_packet(sockaddr_in *addr, Session *session) {
-  packet::SendData packet;
-  packet::make_inform_ball_pos_packet(&packet, session->ball_pos, session->ball_dir);
-  send_packet(addr, packet);
+void send_player_pos_packet(Endpoint *addr, uint16_t client_id) {
+  Motion &motion = client_motion[client_id];
+  packet::encode<packet::PacketType::INFORM_PLAYER_POS>(queue_packet(addr), client_id, motion.pos, motion.dir);
 }
 
-void send_player_pos_packet(sockaddr_in *addr, Client *client) {
-  packet::SendData packet;
-  packet::make_inform_player_pos_packet(&packet, client->id, client->pos, client->dir);
-  send_packet(addr, packet);
+void send_ball_pos_packet(Endpoint *addr, Session *session) {
+  packet::encode<packet::PacketType::INFORM_BALL_POS>(queue_packet(addr), session->ball_pos, session->ball_dir);
 }
 
-void send_point_scored_packet(sockaddr_in *addr, Session *session, uint16_t client_id) {
-  packet::SendData packet;
-  packet::make_inform_point_scored_packet(&packet, session->id, session->main->score, session->secondary->score, client_id);
-  send_packet(addr, packet);
+void send_point_scored_packet(uint16_t to, Session *session, uint16_t client_id) {
+  send_control_packet<packet::PacketType::INFORM_POINT_SCORED>(to, session->id, clients[session->main].score, clients[session->secondary].score, client_id);
 }
 
-void send_player_won_packet(Session *session, Client *client) {
-  packet::SendData packet;
-  packet::make_inform_player_won_packet(&packet, session->id, client->id);
-  send_packet(&session->main->addr, packet);
-  send_packet(&session->secondary->addr, packet);
+void send_player_won_packet(Session *session, uint16_t client_id) {
+  send_control_packet<packet::PacketType::INFORM_WON>(session->main, session->id, client_id);
+  send_control_packet<packet::PacketType::INFORM_WON>(session->secondary, session->id, client_id);
 }
\ No newline at end of file
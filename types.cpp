@@ -38,6 +38,17 @@ namespace types {
     return mf.f;
   }
   
+  uint16_t quantize(float value, Range range) {
+    float scaled = (value - range.min) / (range.max - range.min) * 65535.0f;
+    if(!(scaled > 0.0f)) return 0; // NaN as well
+    if(scaled >= 65535.0f) return 65535;
+    return (uint16_t)(scaled + 0.5f);
+  }
+
+  float dequantize(uint16_t value, Range range) {
+    return range.min + value * ((range.max - range.min) / 65535.0f);
+  }
+  
   // bytes has to be size 12 -> [type:4, x:4, y:4]
   unsigned int encode_vec2(Vector2 vec, uint8_t *bytes) {
     *reinterpret_cast<int*>(&bytes[0]) = VECTOR2;
@@ -65,6 +65,12 @@ namespace types {
     float y;
   };
 
+  // interval a quantized value is spread over, see quantize
+  struct Range {
+    float min;
+    float max;
+  };
+
   unsigned int encode_vec2(Vector2 vec, std::uint8_t *bytes);
   Vector2 decode_vec2(std::uint8_t *bytes);
 
@@ -73,5 +79,9 @@ namespace types {
   unsigned int encode_float(float p_float, std::uint8_t *p_arr);
   float decode_float(const std::uint8_t *p_arr);
 
+  // 16 bit fixed point over range, values outside of it are clamped to its ends
+  uint16_t quantize(float value, Range range);
+  float dequantize(uint16_t value, Range range);
+
 	std::string vec2_to_str(Vector2 vec);
 }
\ No newline at end of file
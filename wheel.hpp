@@ -0,0 +1,84 @@
+#pragma once
+#include <cstdint>
+
+#include "list.hpp"
+
+namespace wheel {
+  // Two level hierarchical timing wheel. The first level has one bucket per tick for the
+  // next 64 ticks, the second one bucket per 64 ticks for the next 4096. Entries of the
+  // second level move down when their block of 64 ticks begins, entries further away park
+  // in the last second level bucket and are placed again from there.
+  //
+  // T needs prev/next (the buckets are list::IntrusiveList<T>), int16_t wheel_bucket
+  // (-1 when not scheduled) and uint64_t wheel_deadline.
+  template<typename T>
+  class TimingWheel {
+  public:
+    static const int SLOT_BITS = 6;
+    static const uint64_t SLOTS = 1 << SLOT_BITS;
+    static const uint64_t SLOT_MASK = SLOTS - 1;
+
+    void start(uint64_t tick) {
+      now = tick;
+    }
+
+    uint64_t current_tick() const { return now; }
+
+    // cheap when the deadline stays in the bucket the entry is already in
+    void schedule(T *item, uint64_t deadline) {
+      int bucket = bucket_for(deadline);
+      item->wheel_deadline = deadline;
+      if(item->wheel_bucket == bucket) return;
+      remove(item);
+      buckets[bucket].push(item);
+      item->wheel_bucket = bucket;
+    }
+
+    void remove(T *item) {
+      if(item->wheel_bucket < 0) return;
+      buckets[item->wheel_bucket].remove(item);
+      item->wheel_bucket = -1;
+    }
+
+    // runs every tick up to and including tick, calling expire for each entry whose
+    // deadline passed. The entry is out of the wheel when expire is called.
+    template<typename F>
+    void advance(uint64_t tick, F expire) {
+      while(now < tick) {
+        now++;
+        if((now & SLOT_MASK) == 0) cascade(SLOTS + ((now >> SLOT_BITS) & SLOT_MASK));
+
+        auto &bucket = buckets[now & SLOT_MASK];
+        T *item;
+        while((item = bucket.front()) != nullptr) {
+          bucket.remove(item);
+          item->wheel_bucket = -1;
+          if(item->wheel_deadline <= now) expire(item);
+          else schedule(item, item->wheel_deadline);
+        }
+      }
+    }
+
+  private:
+    int bucket_for(uint64_t deadline) const {
+      if(deadline <= now) return (now + 1) & SLOT_MASK; // overdue, expires on the next tick
+      uint64_t delta = deadline - now;
+      if(delta < SLOTS) return deadline & SLOT_MASK;
+      if(delta < SLOTS * SLOTS) return SLOTS + ((deadline >> SLOT_BITS) & SLOT_MASK);
+      return SLOTS + (((now >> SLOT_BITS) - 1) & SLOT_MASK);
+    }
+
+    void cascade(int index) {
+      auto &bucket = buckets[index];
+      T *item;
+      while((item = bucket.front()) != nullptr) {
+        bucket.remove(item);
+        item->wheel_bucket = -1;
+        schedule(item, item->wheel_deadline);
+      }
+    }
+
+    uint64_t now = 0;
+    list::IntrusiveList<T> buckets[SLOTS * 2];
+  };
+}